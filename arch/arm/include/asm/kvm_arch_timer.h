@@ -21,7 +21,6 @@
 
 #include <linux/clocksource.h>
 #include <linux/hrtimer.h>
-#include <linux/workqueue.h>
 
 struct arch_timer_kvm {
 #ifdef CONFIG_KVM_ARM_TIMER
@@ -59,15 +58,15 @@ struct arch_timer_cpu {
 	 * here.
 	 */
 
-	/* Background timer used when the guest is not running */
+	/* Background timer used when the vcpu is blocked */
 	struct hrtimer			timer;
 
-	/* Work queued with the above timer expires */
-	struct work_struct		expired;
-
 	/* Background timer active */
 	bool				armed;
 
+	/* Background timer expired, interrupt to be injected on entry */
+	bool				irq_pending;
+
 	/* Timer IRQ */
 	const struct kvm_irq_level	*irq;
 #endif
@@ -80,6 +79,9 @@ void kvm_timer_vcpu_init(struct kvm_vcpu *vcpu);
 void kvm_timer_sync_to_cpu(struct kvm_vcpu *vcpu);
 void kvm_timer_sync_from_cpu(struct kvm_vcpu *vcpu);
 void kvm_timer_vcpu_terminate(struct kvm_vcpu *vcpu);
+bool kvm_timer_should_fire(struct kvm_vcpu *vcpu);
+bool kvm_timer_irq_pending(struct kvm_vcpu *vcpu);
+void kvm_timer_schedule(struct kvm_vcpu *vcpu);
 #else
 static inline int kvm_timer_hyp_init(void)
 {
@@ -95,6 +97,17 @@ static inline void kvm_timer_vcpu_init(struct kvm_vcpu *vcpu) {}
 static inline void kvm_timer_sync_to_cpu(struct kvm_vcpu *vcpu) {}
 static inline void kvm_timer_sync_from_cpu(struct kvm_vcpu *vcpu) {}
 static inline void kvm_timer_vcpu_terminate(struct kvm_vcpu *vcpu) {}
+static inline bool kvm_timer_should_fire(struct kvm_vcpu *vcpu)
+{
+	return false;
+}
+
+static inline bool kvm_timer_irq_pending(struct kvm_vcpu *vcpu)
+{
+	return false;
+}
+
+static inline void kvm_timer_schedule(struct kvm_vcpu *vcpu) {}
 #endif
 
 #endif
@@ -57,6 +57,7 @@
  * TSC:		Trap SMC
  * TSW:		Trap cache operations by set/way
  * TWI:		Trap WFI
+ * TWE:		Trap WFE
  * TIDCP:	Trap L2CTLR/L2ECTLR
  * BSU_IS:	Upgrade barriers to the inner shareable domain
  * FB:		Force broadcast of all maintainance operations
@@ -65,9 +66,9 @@
  * FMO:		Override CPSR.F and enable signaling with VF
  * SWIO:	Turn set/way invalidates into set/way clean+invalidate
  */
-#define HCR_GUEST_MASK (HCR_TSC | HCR_TSW | HCR_TWI | HCR_VM | HCR_BSU_IS | \
-			HCR_FB | HCR_TAC | HCR_AMO | HCR_IMO | HCR_FMO | \
-			HCR_SWIO | HCR_TIDCP)
+#define HCR_GUEST_MASK (HCR_TSC | HCR_TSW | HCR_TWI | HCR_TWE | HCR_VM | \
+			HCR_BSU_IS | HCR_FB | HCR_TAC | HCR_AMO | HCR_IMO | \
+			HCR_FMO | HCR_SWIO | HCR_TIDCP)
 #define HCR_VIRT_EXCP_MASK (HCR_VA | HCR_VI | HCR_VF)
 
 /* System Control Register (SCTLR) bits */
@@ -164,7 +165,8 @@
 #define VTTBR_BADDR_SHIFT (VTTBR_X - 1)
 #define VTTBR_BADDR_MASK  (((1LLU << (40 - VTTBR_X)) - 1) << VTTBR_BADDR_SHIFT)
 #define VTTBR_VMID_SHIFT  (48LLU)
-#define VTTBR_VMID_MASK	  (0xffLLU << VTTBR_VMID_SHIFT)
+#define KVM_VMID_BITS	  8	/* ARMv7 VTTBR.VMID is 8 bits wide */
+#define VTTBR_VMID_MASK	  (((1LLU << KVM_VMID_BITS) - 1) << VTTBR_VMID_SHIFT)
 
 /* Hyp Syndrome Register (HSR) bits */
 #define HSR_EC_SHIFT	(26)
@@ -179,12 +181,14 @@
 #define HSR_FSC_TYPE	(0x3c)
 #define HSR_SSE		(1 << 21)
 #define HSR_WNR		(1 << 6)
+#define HSR_WFI_IS_WFE	(1U << 0)
 #define HSR_CV_SHIFT	(24)
 #define HSR_CV		(1U << HSR_CV_SHIFT)
 #define HSR_COND_SHIFT	(20)
 #define HSR_COND	(0xfU << HSR_COND_SHIFT)
 
 #define FSC_FAULT	(0x04)
+#define FSC_ACCESS	(0x08)
 #define FSC_PERM	(0x0c)
 
 /* Hyp Prefetch Fault Address Register (HPFAR/HDFAR) */
@@ -221,4 +225,8 @@
 #define GICH_APR	0xf0
 #define GICH_LR0	0x100
 
+/* GICH fields used by the world switch */
+#define GICH_HCR_UIE	(1 << 1)
+#define GICH_LR_STATE	(3 << 28)
+
 #endif /* __ARM_KVM_ARM_H__ */
@@ -33,6 +33,9 @@
 
 #define KVM_VCPU_MAX_FEATURES 0
 
+extern raw_spinlock_t kvm_lock;
+extern struct list_head vm_list;
+
 /* We don't currently support large pages. */
 #define KVM_HPAGE_GFN_SHIFT(x)	0
 #define KVM_NR_PAGE_SIZES	1
@@ -58,15 +61,17 @@ struct kvm_arch {
 	 * here.
 	 */
 
-	/* The VMID generation used for the virt. memory system */
-	u64    vmid_gen;
-	u32    vmid;
+	/* VMID, tagged with its generation, see update_vttbr() */
+	atomic64_t vmid;
 
 	/* Stage-2 page table */
 	pgd_t *pgd;
 
 	/* Interrupt controller */
 	struct vgic_dist	vgic;
+
+	/* debugfs kvm/<pid>-<n> directory with this VM's exit statistics */
+	struct dentry *debugfs_dentry;
 };
 
 #define KVM_NR_MEM_OBJS     40
@@ -113,8 +118,8 @@ struct kvm_vcpu_arch {
 	int last_pcpu;
 	cpumask_t require_dcache_flush;
 
-	/* Don't run the guest: see copy_current_insn() */
-	bool pause;
+	/* Current halt-polling window, see kvm_handle_wfi() */
+	unsigned int halt_poll_ns;
 
 	/* IO related fields */
 	struct kvm_decode mmio_decode;
@@ -127,14 +132,47 @@ struct kvm_vcpu_arch {
 
 	/* Cache some mmu pages needed inside spinlock regions */
 	struct kvm_mmu_memory_cache mmu_page_cache;
+
+	/* debugfs vcpuN directory, below the VM's one */
+	struct dentry *debugfs_dentry;
 };
 
 struct kvm_vm_stat {
 	u32 remote_tlb_flush;
+	u32 s2_premapped;	/* pages mapped ahead by fault-around */
 };
 
+/*
+ * Exit handling latency histogram: bucket n counts exits that took
+ * [2^(n-1), 2^n) ns to handle, the last bucket catches everything above.
+ */
+#define KVM_ARM_EXIT_HIST_BUCKETS	24
+
 struct kvm_vcpu_stat {
 	u32 halt_wakeup;
+	u32 halt_poll_success;	/* WFI wakeups caught while polling */
+	u32 halt_poll_fail;	/* WFI polls that ended up blocking */
+	u32 s2_block_map;	/* Stage-2 faults mapped with a PMD block */
+	u32 s2_page_map;	/* Stage-2 faults mapped with a page */
+	u32 s2_access_fault;	/* Accesses to pages aged by the host */
+
+	/* Exits, by reason */
+	u32 exit_irq;		/* Host interrupt */
+	u32 exit_wfi;
+	u32 exit_wfe;
+	u32 wfe_yield;		/* WFE exits that yielded to another vcpu */
+	u32 wfe_yield_fail;	/* WFE exits with no vcpu to yield to */
+	u32 exit_cp15;
+	u32 exit_cp14;		/* CP14, CP10 ID and CP0-13 accesses */
+	u32 exit_hvc;
+	u32 exit_smc;
+	u32 exit_s2_fault;	/* Stage-2 fault on guest RAM */
+	u32 exit_mmio_kernel;	/* MMIO completed in the kernel */
+	u32 exit_mmio_user;	/* MMIO forwarded to user space */
+	u32 vgic_maint_irq;	/* VGIC maintenance interrupts */
+	u32 vgic_lr_overflow;	/* Entries with more pending IRQs than LRs */
+
+	u32 exit_latency[KVM_ARM_EXIT_HIST_BUCKETS];
 };
 
 struct kvm_vcpu_init;
@@ -145,6 +183,9 @@ int kvm_arm_copy_reg_indices(struct kvm_vcpu *vcpu, u64 __user *indices);
 struct kvm_one_reg;
 int kvm_arm_get_reg(struct kvm_vcpu *vcpu, const struct kvm_one_reg *reg);
 int kvm_arm_set_reg(struct kvm_vcpu *vcpu, const struct kvm_one_reg *reg);
+struct kvm_reg_batch;
+int kvm_arm_reg_batch(struct kvm_vcpu *vcpu, const struct kvm_reg_batch *batch,
+		      bool set);
 u64 kvm_call_hyp(void *hypfn, ...);
 
 #define KVM_ARCH_WANT_MMU_NOTIFIER
@@ -153,21 +194,12 @@ int kvm_unmap_hva(struct kvm *kvm, unsigned long hva);
 int kvm_unmap_hva_range(struct kvm *kvm,
 			unsigned long start, unsigned long end);
 void kvm_set_spte_hva(struct kvm *kvm, unsigned long hva, pte_t pte);
+int kvm_age_hva(struct kvm *kvm, unsigned long hva);
+int kvm_test_age_hva(struct kvm *kvm, unsigned long hva);
 
 unsigned long kvm_arm_num_regs(struct kvm_vcpu *vcpu);
 int kvm_arm_copy_reg_indices(struct kvm_vcpu *vcpu, u64 __user *indices);
 
-/* We do not have shadow page tables, hence the empty hooks */
-static inline int kvm_age_hva(struct kvm *kvm, unsigned long hva)
-{
-	return 0;
-}
-
-static inline int kvm_test_age_hva(struct kvm *kvm, unsigned long hva)
-{
-	return 0;
-}
-
 struct kvm_vcpu *kvm_arm_get_running_vcpu(void);
 struct kvm_vcpu __percpu **kvm_get_running_vcpus(void);
 
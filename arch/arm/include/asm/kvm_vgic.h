@@ -28,13 +28,20 @@
 
 #define VGIC_NR_IRQS		128
 #define VGIC_NR_SHARED_IRQS	(VGIC_NR_IRQS - 32)
-#define VGIC_MAX_CPUS		KVM_MAX_VCPUS
 
-/* Sanity checks... */
-#if (VGIC_MAX_CPUS > 8)
-#error	Invalid number of CPU interfaces
+/*
+ * GICv2 cannot address more than 8 CPU interfaces (GICD_ITARGETSRn,
+ * GICD_SGIR and the LR CPUID field). VMs with more vcpus can still be
+ * run, just not with the in-kernel irqchip.
+ */
+#define VGIC_V2_MAX_CPUS	8
+#if (KVM_MAX_VCPUS > VGIC_V2_MAX_CPUS)
+#define VGIC_MAX_CPUS		VGIC_V2_MAX_CPUS
+#else
+#define VGIC_MAX_CPUS		KVM_MAX_VCPUS
 #endif
 
+/* Sanity checks... */
 #if (VGIC_NR_IRQS & 31)
 #error "VGIC_NR_IRQS must be a multiple of 32"
 #endif
@@ -187,14 +194,17 @@ struct vgic_dist {
 	/* Target CPU for each IRQ */
 	u8			irq_spi_cpu[VGIC_NR_SHARED_IRQS];
 	struct vgic_bitmap	irq_spi_target[VGIC_MAX_CPUS];
-
-	/* Bitmap indicating which CPU has something pending */
-	unsigned long		irq_pending_on_cpu;
 #endif
 };
 
 struct vgic_cpu {
 #ifdef CONFIG_KVM_ARM_VGIC
+	/*
+	 * Protects this vcpu's banked SGI/PPI state in the distributor,
+	 * its pending bitmaps and the LR sync. Nests inside dist->lock.
+	 */
+	spinlock_t	lock;
+
 	/* per IRQ to LR mapping */
 	u8		vgic_irq_lr_map[VGIC_NR_IRQS];
 
@@ -202,6 +212,9 @@ struct vgic_cpu {
 	DECLARE_BITMAP(	pending_percpu, 32);
 	DECLARE_BITMAP(	pending_shared, VGIC_NR_SHARED_IRQS);
 
+	/* Level-triggered SPIs EOIed by the guest, for the ack notifiers */
+	DECLARE_BITMAP(	eoied_shared, VGIC_NR_SHARED_IRQS);
+
 	/* Bitmap of used/free list registers */
 	DECLARE_BITMAP(	lr_used, 64);
 
@@ -219,6 +232,9 @@ struct vgic_cpu {
 
 	/* Number of level-triggered interrupt in progress */
 	atomic_t	irq_active_count;
+
+	/* VGIC_CPU_PENDING/VGIC_CPU_KICK, set from any CPU */
+	unsigned long	flags;
 #endif
 };
 
@@ -227,6 +243,8 @@ struct vgic_cpu {
 
 #define VGIC_LR_VIRTUALID	(0x3ff << 0)
 #define VGIC_LR_PHYSID_CPUID	(7 << 10)
+#define VGIC_LR_PRIORITY_SHIFT	23
+#define VGIC_LR_PRIORITY	(0x1f << VGIC_LR_PRIORITY_SHIFT)
 #define VGIC_LR_STATE		(3 << 28)
 #define VGIC_LR_PENDING_BIT	(1 << 28)
 #define VGIC_LR_ACTIVE_BIT	(1 << 29)
@@ -237,6 +255,10 @@ struct vgic_cpu {
 
 #define LR_EMPTY	0xff
 
+/* vgic_cpu flags: something is pending, and the vcpu needs a kick */
+#define VGIC_CPU_PENDING	0
+#define VGIC_CPU_KICK		1
+
 struct kvm;
 struct kvm_vcpu;
 struct kvm_run;
@@ -255,6 +277,8 @@ int kvm_vgic_inject_irq(struct kvm *kvm, int cpuid, unsigned int irq_num,
 int kvm_vgic_vcpu_pending_irq(struct kvm_vcpu *vcpu);
 bool vgic_handle_mmio(struct kvm_vcpu *vcpu, struct kvm_run *run,
 		      struct kvm_exit_mmio *mmio);
+int kvm_vgic_get_state(struct kvm *kvm, struct kvm_arm_vgic_state __user *ustate);
+int kvm_vgic_set_state(struct kvm *kvm, struct kvm_arm_vgic_state __user *ustate);
 
 #define irqchip_in_kernel(k)	(!!((k)->arch.vgic.vctrl_base))
 #define vgic_initialized(k)	((k)->arch.vgic.ready)
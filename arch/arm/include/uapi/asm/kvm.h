@@ -134,4 +134,44 @@ struct kvm_arch_memory_slot {
 /* Highest supported SPI, from VGIC_NR_IRQS */
 #define KVM_ARM_IRQ_GIC_MAX		127
 
+/* KVM_ARM_GET_VGIC_STATE/KVM_ARM_SET_VGIC_STATE */
+#define KVM_ARM_VGIC_NR_IRQS		128
+#define KVM_ARM_VGIC_NR_SPIS		(KVM_ARM_VGIC_NR_IRQS - 32)
+#define KVM_ARM_VGIC_NR_LRS		64
+
+/* Distributor state, shared interrupts (SPIs) only */
+struct kvm_arm_vgic_dist_state {
+	__u32 enabled;
+	__u32 nr_irqs;
+	/* One bit per SPI; irq_cfg bits are set for edge-triggered SPIs */
+	__u32 irq_enabled[KVM_ARM_VGIC_NR_SPIS / 32];
+	__u32 irq_state[KVM_ARM_VGIC_NR_SPIS / 32];
+	__u32 irq_active[KVM_ARM_VGIC_NR_SPIS / 32];
+	__u32 irq_cfg[KVM_ARM_VGIC_NR_SPIS / 32];
+	__u8  irq_priority[KVM_ARM_VGIC_NR_SPIS];
+	__u8  irq_target[KVM_ARM_VGIC_NR_SPIS];	/* vcpu index */
+};
+
+/* Banked distributor state (SGIs and PPIs) and CPU interface of a vcpu */
+struct kvm_arm_vgic_cpu_state {
+	__u32 irq_enabled;
+	__u32 irq_state;
+	__u32 irq_active;
+	__u32 irq_cfg;
+	__u8  irq_priority[32];
+	__u8  sgi_sources[16];	/* mask of source vcpus, per SGI */
+	__u32 vgic_hcr;
+	__u32 vgic_vmcr;
+	__u32 vgic_apr;
+	__u32 nr_lr;
+	__u32 vgic_lr[KVM_ARM_VGIC_NR_LRS];
+};
+
+struct kvm_arm_vgic_state {
+	__u32 nr_cpus;
+	__u32 flags;
+	struct kvm_arm_vgic_dist_state dist;
+	struct kvm_arm_vgic_cpu_state cpu[0];
+};
+
 #endif /* __ARM_KVM_H__ */
@@ -25,6 +25,8 @@
 #include <linux/mman.h>
 #include <linux/sched.h>
 #include <linux/kvm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <trace/events/kvm.h>
 
 #define CREATE_TRACE_POINTS
@@ -49,6 +51,14 @@
 __asm__(".arch_extension	virt");
 #endif
 
+#undef MODULE_PARAM_PREFIX
+#define MODULE_PARAM_PREFIX	"kvm_arm."
+
+static bool exit_latency_hist;
+module_param(exit_latency_hist, bool, 0644);
+MODULE_PARM_DESC(exit_latency_hist,
+		 "Record exit handling latency histograms in debugfs");
+
 static DEFINE_PER_CPU(unsigned long, kvm_arm_hyp_stack_page);
 static struct vfp_hard_struct __percpu *kvm_host_vfp_state;
 static unsigned long hyp_default_vectors;
@@ -56,11 +66,27 @@ static unsigned long hyp_default_vectors;
 /* Per-CPU variable containing the currently running vcpu. */
 static DEFINE_PER_CPU(struct kvm_vcpu *, kvm_arm_running_vcpu);
 
-/* The VMID used in the VTTBR */
-static atomic64_t kvm_vmid_gen = ATOMIC64_INIT(1);
-static u8 kvm_next_vmid;
+/*
+ * VMID allocation. A VM's VMID is tagged with the generation it was
+ * allocated in (kvm->arch.vmid holds both, generation in the upper
+ * bits). On rollover, VMIDs currently live on some CPU are carried over
+ * to the new generation, and each CPU flushes its own TLB the next time
+ * it enters a guest.
+ */
+#define VMID_MASK		((1ULL << KVM_VMID_BITS) - 1)
+#define VMID_FIRST_VERSION	(1ULL << KVM_VMID_BITS)
+#define NUM_VMIDS		(1UL << KVM_VMID_BITS)
+
+static atomic64_t kvm_vmid_gen = ATOMIC64_INIT(VMID_FIRST_VERSION);
+static DECLARE_BITMAP(kvm_vmid_map, NUM_VMIDS);
+static unsigned long kvm_next_vmid = 1;
 static DEFINE_SPINLOCK(kvm_vmid_lock);
 
+/* VMID each CPU is running, and the one it kept over the last rollover */
+static DEFINE_PER_CPU(atomic64_t, kvm_active_vmids);
+static DEFINE_PER_CPU(u64, kvm_reserved_vmids);
+static cpumask_t kvm_vmid_flush_pending;
+
 static bool vgic_present;
 
 static void kvm_arm_set_running_vcpu(struct kvm_vcpu *vcpu)
@@ -127,6 +153,210 @@ void kvm_arch_sync_events(struct kvm *kvm)
 {
 }
 
+/*
+ * Per-VM and per-vcpu exit statistics, in debugfs kvm/<pid>-<n>/ and
+ * kvm/<pid>-<n>/vcpuN/. The global kvm/ files sum over every VM, these
+ * attribute the exits to a guest and to one of its vcpus. Each reader
+ * holds a reference on the VM. The vcpu directories are only created
+ * for online vcpus, which are freed with the VM, so neither can go away
+ * while a file is open.
+ */
+static atomic_t kvm_arm_vm_seq = ATOMIC_INIT(0);
+
+static void kvm_arm_show_exit_latency(struct seq_file *m, u64 *hist)
+{
+	int b;
+
+	seq_puts(m, "# ns (>=)      exits\n");
+	for (b = 0; b < KVM_ARM_EXIT_HIST_BUCKETS; b++)
+		seq_printf(m, "%10llu %10llu\n",
+			   b ? 1ULL << (b - 1) : 0ULL, hist[b]);
+}
+
+static int vm_stats_show(struct seq_file *m, void *v)
+{
+	struct kvm *kvm = m->private;
+	struct kvm_stats_debugfs_item *p;
+	struct kvm_vcpu *vcpu;
+	u64 val;
+	int i;
+
+	for (p = debugfs_entries; p->name; p++) {
+		val = 0;
+		if (p->kind == KVM_STAT_VM)
+			val = *(u32 *)((void *)kvm + p->offset);
+		else
+			kvm_for_each_vcpu(i, vcpu, kvm)
+				val += *(u32 *)((void *)vcpu + p->offset);
+		seq_printf(m, "%-20s %llu\n", p->name, val);
+	}
+	return 0;
+}
+
+static int vm_exit_latency_show(struct seq_file *m, void *v)
+{
+	u64 hist[KVM_ARM_EXIT_HIST_BUCKETS] = { 0 };
+	struct kvm *kvm = m->private;
+	struct kvm_vcpu *vcpu;
+	int i, b;
+
+	kvm_for_each_vcpu(i, vcpu, kvm)
+		for (b = 0; b < KVM_ARM_EXIT_HIST_BUCKETS; b++)
+			hist[b] += vcpu->stat.exit_latency[b];
+
+	kvm_arm_show_exit_latency(m, hist);
+	return 0;
+}
+
+static int vcpu_stats_show(struct seq_file *m, void *v)
+{
+	struct kvm_vcpu *vcpu = m->private;
+	struct kvm_stats_debugfs_item *p;
+
+	for (p = debugfs_entries; p->name; p++) {
+		if (p->kind != KVM_STAT_VCPU)
+			continue;
+		seq_printf(m, "%-20s %u\n", p->name,
+			   *(u32 *)((void *)vcpu + p->offset));
+	}
+	return 0;
+}
+
+static int vcpu_exit_latency_show(struct seq_file *m, void *v)
+{
+	u64 hist[KVM_ARM_EXIT_HIST_BUCKETS];
+	struct kvm_vcpu *vcpu = m->private;
+	int b;
+
+	for (b = 0; b < KVM_ARM_EXIT_HIST_BUCKETS; b++)
+		hist[b] = vcpu->stat.exit_latency[b];
+
+	kvm_arm_show_exit_latency(m, hist);
+	return 0;
+}
+
+static int kvm_arm_stat_open(struct file *file, struct kvm *kvm,
+			     int (*show)(struct seq_file *, void *), void *data)
+{
+	int ret;
+
+	/* The VM is already on its way out */
+	if (!atomic_inc_not_zero(&kvm->users_count))
+		return -ENOENT;
+
+	ret = single_open(file, show, data);
+	if (ret)
+		kvm_put_kvm(kvm);
+	return ret;
+}
+
+static int vm_stat_release(struct inode *inode, struct file *file)
+{
+	kvm_put_kvm(inode->i_private);
+	return single_release(inode, file);
+}
+
+static int vcpu_stat_release(struct inode *inode, struct file *file)
+{
+	struct kvm_vcpu *vcpu = inode->i_private;
+
+	kvm_put_kvm(vcpu->kvm);
+	return single_release(inode, file);
+}
+
+#define KVM_ARM_VM_STAT_FOPS(name)					\
+static int name##_open(struct inode *inode, struct file *file)		\
+{									\
+	return kvm_arm_stat_open(file, inode->i_private,		\
+				 name##_show, inode->i_private);	\
+}									\
+static const struct file_operations name##_fops = {			\
+	.open		= name##_open,					\
+	.read		= seq_read,					\
+	.llseek		= seq_lseek,					\
+	.release	= vm_stat_release,				\
+}
+
+#define KVM_ARM_VCPU_STAT_FOPS(name)					\
+static int name##_open(struct inode *inode, struct file *file)		\
+{									\
+	struct kvm_vcpu *vcpu = inode->i_private;			\
+									\
+	return kvm_arm_stat_open(file, vcpu->kvm, name##_show, vcpu);	\
+}									\
+static const struct file_operations name##_fops = {			\
+	.open		= name##_open,					\
+	.read		= seq_read,					\
+	.llseek		= seq_lseek,					\
+	.release	= vcpu_stat_release,				\
+}
+
+KVM_ARM_VM_STAT_FOPS(vm_stats);
+KVM_ARM_VM_STAT_FOPS(vm_exit_latency);
+KVM_ARM_VCPU_STAT_FOPS(vcpu_stats);
+KVM_ARM_VCPU_STAT_FOPS(vcpu_exit_latency);
+
+/*
+ * debugfs is only a debugging aid: failing to populate it never fails
+ * vcpu initialization. The VM directory is created along with the first
+ * vcpu one, as kvm_create_vm() may still fail after kvm_arch_init_vm()
+ * without ever calling kvm_arch_destroy_vm(). Called with kvm->lock held.
+ */
+static void kvm_arm_vm_debugfs_init(struct kvm *kvm)
+{
+	struct dentry *dir;
+	char name[32];
+
+	snprintf(name, sizeof(name), "%d-%d", task_pid_nr(current),
+		 atomic_inc_return(&kvm_arm_vm_seq));
+	dir = debugfs_create_dir(name, kvm_debugfs_dir);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	if (!debugfs_create_file("stats", 0444, dir, kvm, &vm_stats_fops) ||
+	    !debugfs_create_file("exit_latency", 0444, dir, kvm,
+				 &vm_exit_latency_fops)) {
+		kvm_err("Cannot create debugfs files for VM %s\n", name);
+		debugfs_remove_recursive(dir);
+		return;
+	}
+
+	kvm->arch.debugfs_dentry = dir;
+}
+
+/*
+ * Called on KVM_ARM_VCPU_INIT, with vcpu->mutex held: the vcpu is online
+ * by then, kvm_vm_ioctl_create_vcpu() can no longer free it under us.
+ */
+static void kvm_arm_vcpu_debugfs_init(struct kvm_vcpu *vcpu)
+{
+	struct dentry *dir;
+	char name[16];
+
+	mutex_lock(&vcpu->kvm->lock);
+	if (!vcpu->kvm->arch.debugfs_dentry)
+		kvm_arm_vm_debugfs_init(vcpu->kvm);
+	mutex_unlock(&vcpu->kvm->lock);
+
+	if (!vcpu->kvm->arch.debugfs_dentry)
+		return;
+
+	snprintf(name, sizeof(name), "vcpu%d", vcpu->vcpu_id);
+	dir = debugfs_create_dir(name, vcpu->kvm->arch.debugfs_dentry);
+	if (!dir)
+		return;
+
+	if (!debugfs_create_file("stats", 0444, dir, vcpu,
+				 &vcpu_stats_fops) ||
+	    !debugfs_create_file("exit_latency", 0444, dir, vcpu,
+				 &vcpu_exit_latency_fops)) {
+		debugfs_remove_recursive(dir);
+		return;
+	}
+
+	vcpu->arch.debugfs_dentry = dir;
+}
+
 /**
  * kvm_arch_init_vm - initializes a VM data structure
  * @kvm:	pointer to the KVM struct
@@ -146,8 +376,8 @@ int kvm_arch_init_vm(struct kvm *kvm, unsigned long type)
 	if (ret)
 		goto out_free_stage2_pgd;
 
-	/* Mark the initial VMID generation invalid */
-	kvm->arch.vmid_gen = 0;
+	/* No VMID allocated yet */
+	atomic64_set(&kvm->arch.vmid, 0);
 
 	return ret;
 out_free_stage2_pgd:
@@ -187,6 +417,9 @@ void kvm_arch_destroy_vm(struct kvm *kvm)
 			kvm->vcpus[i] = NULL;
 		}
 	}
+
+	/* The vcpus have removed their own directories below this one */
+	debugfs_remove_recursive(kvm->arch.debugfs_dentry);
 }
 
 int kvm_dev_ioctl_check_extension(long ext)
@@ -195,6 +428,9 @@ int kvm_dev_ioctl_check_extension(long ext)
 	switch (ext) {
 #ifdef CONFIG_KVM_ARM_VGIC
 	case KVM_CAP_IRQCHIP:
+	case KVM_CAP_IRQFD:
+	case KVM_CAP_IRQFD_RESAMPLE:
+	case KVM_CAP_ARM_VGIC_STATE:
 		r = vgic_present;
 		break;
 #endif
@@ -202,6 +438,8 @@ int kvm_dev_ioctl_check_extension(long ext)
 	case KVM_CAP_SYNC_MMU:
 	case KVM_CAP_DESTROY_MEMORY_REGION_WORKS:
 	case KVM_CAP_ONE_REG:
+	case KVM_CAP_ONE_REG_BATCH:
+	case KVM_CAP_IOEVENTFD:
 		r = 1;
 		break;
 	case KVM_CAP_COALESCED_MMIO:
@@ -245,6 +483,14 @@ void kvm_arch_commit_memory_region(struct kvm *kvm,
 				   struct kvm_memory_slot old,
 				   int user_alloc)
 {
+	/*
+	 * Start tracking writes as soon as dirty logging gets enabled on
+	 * the slot: every existing stage-2 mapping is made read-only and
+	 * the subsequent permission faults populate the dirty bitmap.
+	 */
+	if ((mem->flags & KVM_MEM_LOG_DIRTY_PAGES) &&
+	    !(old.flags & KVM_MEM_LOG_DIRTY_PAGES))
+		kvm_mmu_wp_memory_region(kvm, mem->slot);
 }
 
 void kvm_arch_flush_shadow_all(struct kvm *kvm)
@@ -286,6 +532,7 @@ out:
 
 void kvm_arch_vcpu_free(struct kvm_vcpu *vcpu)
 {
+	debugfs_remove_recursive(vcpu->arch.debugfs_dentry);
 	kvm_mmu_free_memory_caches(vcpu);
 	kvm_timer_vcpu_terminate(vcpu);
 	kmem_cache_free(kvm_vcpu_cache, vcpu);
@@ -298,7 +545,7 @@ void kvm_arch_vcpu_destroy(struct kvm_vcpu *vcpu)
 
 int kvm_cpu_has_pending_timer(struct kvm_vcpu *vcpu)
 {
-	return 0;
+	return kvm_timer_irq_pending(vcpu);
 }
 
 int __attribute_const__ kvm_target_cpu(void)
@@ -399,69 +646,134 @@ int kvm_arch_vcpu_in_guest_mode(struct kvm_vcpu *v)
 	return v->mode == IN_GUEST_MODE;
 }
 
-static void reset_vm_context(void *info)
+/*
+ * Start a new VMID generation. Called with kvm_vmid_lock held, when all
+ * VMIDs of the current generation are in use.
+ */
+static void flush_vmid_context(void)
+{
+	int cpu;
+	u64 vmid;
+
+	bitmap_zero(kvm_vmid_map, NUM_VMIDS);
+	__set_bit(0, kvm_vmid_map);	/* Reserved for the host */
+
+	for_each_possible_cpu(cpu) {
+		vmid = atomic64_xchg(&per_cpu(kvm_active_vmids, cpu), 0);
+
+		/*
+		 * If this CPU has already been through a rollover without
+		 * running a guest in between, keep its previously reserved
+		 * VMID: that's what its TLB still holds entries for.
+		 */
+		if (vmid == 0)
+			vmid = per_cpu(kvm_reserved_vmids, cpu);
+		__set_bit(vmid & VMID_MASK, kvm_vmid_map);
+		per_cpu(kvm_reserved_vmids, cpu) = vmid;
+	}
+
+	/* Each CPU flushes its own TLB before it next enters a guest */
+	cpumask_setall(&kvm_vmid_flush_pending);
+}
+
+/*
+ * If @vmid was reserved on some CPU during the last rollover, move all
+ * reservations of it to the current generation.
+ */
+static bool check_update_reserved_vmid(u64 vmid, u64 newvmid)
 {
-	kvm_call_hyp(__kvm_flush_vm_context);
+	bool hit = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(kvm_reserved_vmids, cpu) == vmid) {
+			hit = true;
+			per_cpu(kvm_reserved_vmids, cpu) = newvmid;
+		}
+	}
+
+	return hit;
 }
 
-/**
- * need_new_vmid_gen - check that the VMID is still valid
- * @kvm: The VM's VMID to checkt
- *
- * return true if there is a new generation of VMIDs being used
- *
- * The hardware supports only 256 values with the value zero reserved for the
- * host, so we check if an assigned value belongs to a previous generation,
- * which which requires us to assign a new value. If we're the first to use a
- * VMID for the new generation, we must flush necessary caches and TLBs on all
- * CPUs.
+/*
+ * Pick a VMID in the current generation for @kvm, preferably the one it
+ * already had. Called with kvm_vmid_lock held.
  */
-static bool need_new_vmid_gen(struct kvm *kvm)
+static u64 new_vmid(struct kvm *kvm)
 {
-	return unlikely(kvm->arch.vmid_gen != atomic64_read(&kvm_vmid_gen));
+	u64 vmid = atomic64_read(&kvm->arch.vmid);
+	u64 generation = atomic64_read(&kvm_vmid_gen);
+	unsigned long idx;
+
+	if (vmid != 0) {
+		u64 newvmid = generation | (vmid & VMID_MASK);
+
+		/* Still live on some CPU since the last rollover? */
+		if (check_update_reserved_vmid(vmid, newvmid))
+			return newvmid;
+
+		/* Nobody took it in this generation either? */
+		if (!__test_and_set_bit(vmid & VMID_MASK, kvm_vmid_map))
+			return newvmid;
+	}
+
+	idx = find_next_zero_bit(kvm_vmid_map, NUM_VMIDS, kvm_next_vmid);
+	if (idx == NUM_VMIDS) {
+		generation = atomic64_add_return(VMID_FIRST_VERSION,
+						 &kvm_vmid_gen);
+		flush_vmid_context();
+		idx = find_next_zero_bit(kvm_vmid_map, NUM_VMIDS, 1);
+	}
+
+	__set_bit(idx, kvm_vmid_map);
+	kvm_next_vmid = idx;
+	return generation | idx;
 }
 
 /**
  * update_vttbr - Update the VTTBR with a valid VMID before the guest runs
  * @kvm	The guest that we are about to run
  *
- * Called from kvm_arch_vcpu_ioctl_run before entering the guest to ensure the
- * VM has a valid VMID, otherwise assigns a new one and flushes corresponding
- * caches and TLBs.
+ * Called from kvm_arch_vcpu_ioctl_run with interrupts disabled, right
+ * before entering the guest. In the common case the VM's VMID belongs to
+ * the current generation and this CPU has not seen a rollover since it
+ * last ran a guest: we only record the VMID as live on this CPU.
+ * Otherwise we take the allocator lock, get a VMID for the current
+ * generation, and flush this CPU's TLB if a rollover happened since.
  */
 static void update_vttbr(struct kvm *kvm)
 {
+	atomic64_t *active = &__get_cpu_var(kvm_active_vmids);
 	phys_addr_t pgd_phys;
-	u64 vmid;
+	u64 vmid, old_active;
+	int cpu;
 
-	if (!need_new_vmid_gen(kvm))
+	vmid = atomic64_read(&kvm->arch.vmid);
+	old_active = atomic64_read(active);
+	if (old_active &&
+	    !((vmid ^ atomic64_read(&kvm_vmid_gen)) >> KVM_VMID_BITS) &&
+	    atomic64_cmpxchg(active, old_active, vmid) == old_active)
 		return;
 
 	spin_lock(&kvm_vmid_lock);
 
-	/* First user of a new VMID generation? */
-	if (unlikely(kvm_next_vmid == 0)) {
-		atomic64_inc(&kvm_vmid_gen);
-		kvm_next_vmid = 1;
+	vmid = atomic64_read(&kvm->arch.vmid);
+	if ((vmid ^ atomic64_read(&kvm_vmid_gen)) >> KVM_VMID_BITS) {
+		vmid = new_vmid(kvm);
+		atomic64_set(&kvm->arch.vmid, vmid);
 
-		/*
-		 * On SMP we know no other CPUs can use this CPU's or
-		 * each other's VMID since the kvm_vmid_lock blocks
-		 * them from reentry to the guest.
-		 */
-		on_each_cpu(reset_vm_context, NULL, 1);
+		/* update vttbr to be used with the new vmid */
+		pgd_phys = virt_to_phys(kvm->arch.pgd);
+		kvm->arch.vttbr = pgd_phys & VTTBR_BADDR_MASK;
+		kvm->arch.vttbr |= ((vmid & VMID_MASK) << VTTBR_VMID_SHIFT) &
+				   VTTBR_VMID_MASK;
 	}
 
-	kvm->arch.vmid_gen = atomic64_read(&kvm_vmid_gen);
-	kvm->arch.vmid = kvm_next_vmid;
-	kvm_next_vmid++;
-
-	/* update vttbr to be used with the new vmid */
-	pgd_phys = virt_to_phys(kvm->arch.pgd);
-	vmid = ((u64)(kvm->arch.vmid) << VTTBR_VMID_SHIFT) & VTTBR_VMID_MASK;
-	kvm->arch.vttbr = pgd_phys & VTTBR_BADDR_MASK;
-	kvm->arch.vttbr |= vmid;
+	cpu = smp_processor_id();
+	if (cpumask_test_and_clear_cpu(cpu, &kvm_vmid_flush_pending))
+		kvm_call_hyp(__kvm_flush_vm_context);
 
+	atomic64_set(active, vmid);
 	spin_unlock(&kvm_vmid_lock);
 }
 
@@ -573,6 +885,56 @@ static bool kvm_condition_valid(struct kvm_vcpu *vcpu)
 	return arm_check_condition(insn, cpsr) != ARM_OPCODE_CONDTEST_FAIL;
 }
 
+static void kvm_arm_count_exit(struct kvm_vcpu *vcpu, unsigned long hsr_ec)
+{
+	switch (hsr_ec) {
+	case HSR_EC_WFI:
+		if (vcpu->arch.hsr & HSR_WFI_IS_WFE)
+			++vcpu->stat.exit_wfe;
+		else
+			++vcpu->stat.exit_wfi;
+		break;
+	case HSR_EC_CP15_32:
+	case HSR_EC_CP15_64:
+		++vcpu->stat.exit_cp15;
+		break;
+	case HSR_EC_CP14_MR:
+	case HSR_EC_CP14_LS:
+	case HSR_EC_CP14_64:
+	case HSR_EC_CP_0_13:
+	case HSR_EC_CP10_ID:
+		++vcpu->stat.exit_cp14;
+		break;
+	case HSR_EC_HVC:
+		++vcpu->stat.exit_hvc;
+		break;
+	case HSR_EC_SMC:
+		++vcpu->stat.exit_smc;
+		break;
+	}
+}
+
+/*
+ * Record how long handle_exit() took. WFI/WFE are left out: the time
+ * spent there is the guest sleeping or yielding, not the cost of
+ * handling the exit.
+ */
+static void kvm_arm_record_exit_latency(struct kvm_vcpu *vcpu,
+					int exception_index, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket;
+
+	if (exception_index != ARM_EXCEPTION_IRQ &&
+	    ((vcpu->arch.hsr & HSR_EC) >> HSR_EC_SHIFT) == HSR_EC_WFI)
+		return;
+
+	bucket = fls((u32)min_t(s64, ns, UINT_MAX));
+	if (bucket >= KVM_ARM_EXIT_HIST_BUCKETS)
+		bucket = KVM_ARM_EXIT_HIST_BUCKETS - 1;
+	++vcpu->stat.exit_latency[bucket];
+}
+
 /*
  * Return > 0 to return to guest, < 0 on error, 0 (and set exit_reason) on
  * proper exit to QEMU.
@@ -584,6 +946,7 @@ static int handle_exit(struct kvm_vcpu *vcpu, struct kvm_run *run,
 
 	switch (exception_index) {
 	case ARM_EXCEPTION_IRQ:
+		++vcpu->stat.exit_irq;
 		return 1;
 	case ARM_EXCEPTION_UNDEFINED:
 		kvm_err("Undefined exception in Hyp mode at: %#08x\n",
@@ -613,6 +976,7 @@ static int handle_exit(struct kvm_vcpu *vcpu, struct kvm_run *run,
 			return 1;
 		}
 
+		kvm_arm_count_exit(vcpu, hsr_ec);
 		return arm_exit_handlers[hsr_ec](vcpu, run);
 	default:
 		kvm_pr_unimpl("Unsupported exception type: %d",
@@ -667,10 +1031,9 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *run)
 		 */
 		cond_resched();
 
-		update_vttbr(vcpu->kvm);
-
-		kvm_vgic_sync_to_cpu(vcpu);
+		/* Timer first, so that an expired timer makes it to an LR */
 		kvm_timer_sync_to_cpu(vcpu);
+		kvm_vgic_sync_to_cpu(vcpu);
 
 		local_irq_disable();
 
@@ -682,13 +1045,15 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *run)
 			run->exit_reason = KVM_EXIT_INTR;
 		}
 
-		if (ret <= 0 || need_new_vmid_gen(vcpu->kvm)) {
+		if (ret <= 0) {
 			local_irq_enable();
 			kvm_timer_sync_from_cpu(vcpu);
 			kvm_vgic_sync_from_cpu(vcpu);
 			continue;
 		}
 
+		update_vttbr(vcpu->kvm);
+
 		/**************************************************************
 		 * Enter the guest
 		 */
@@ -696,13 +1061,7 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *run)
 		kvm_guest_enter();
 		vcpu->mode = IN_GUEST_MODE;
 
-		smp_mb(); /* set mode before reading vcpu->arch.pause */
-		if (unlikely(vcpu->arch.pause)) {
-			/* This means ignore, try again. */
-			ret = ARM_EXCEPTION_IRQ;
-		} else {
-			ret = kvm_call_hyp(__kvm_vcpu_run, vcpu);
-		}
+		ret = kvm_call_hyp(__kvm_vcpu_run, vcpu);
 
 		vcpu->mode = OUTSIDE_GUEST_MODE;
 		vcpu->arch.last_pcpu = smp_processor_id();
@@ -727,7 +1086,16 @@ int kvm_arch_vcpu_ioctl_run(struct kvm_vcpu *vcpu, struct kvm_run *run)
 		kvm_timer_sync_from_cpu(vcpu);
 		kvm_vgic_sync_from_cpu(vcpu);
 
-		ret = handle_exit(vcpu, run, ret);
+		if (unlikely(exit_latency_hist)) {
+			int exception_index = ret;
+			ktime_t start = ktime_get();
+
+			ret = handle_exit(vcpu, run, exception_index);
+			kvm_arm_record_exit_latency(vcpu, exception_index,
+						    start);
+		} else {
+			ret = handle_exit(vcpu, run, ret);
+		}
 	}
 
 	if (vcpu->sigset_active)
@@ -833,11 +1201,15 @@ long kvm_arch_vcpu_ioctl(struct file *filp,
 	switch (ioctl) {
 	case KVM_ARM_VCPU_INIT: {
 		struct kvm_vcpu_init init;
+		int err;
 
 		if (copy_from_user(&init, argp, sizeof init))
 			return -EFAULT;
 
-		return kvm_vcpu_set_target(vcpu, &init);
+		err = kvm_vcpu_set_target(vcpu, &init);
+		if (!err && !vcpu->arch.debugfs_dentry)
+			kvm_arm_vcpu_debugfs_init(vcpu);
+		return err;
 
 	}
 	case KVM_SET_ONE_REG:
@@ -850,6 +1222,14 @@ long kvm_arch_vcpu_ioctl(struct file *filp,
 		else
 			return kvm_arm_get_reg(vcpu, &reg);
 	}
+	case KVM_SET_REG_BATCH:
+	case KVM_GET_REG_BATCH: {
+		struct kvm_reg_batch batch;
+		if (copy_from_user(&batch, argp, sizeof(batch)))
+			return -EFAULT;
+		return kvm_arm_reg_batch(vcpu, &batch,
+					 ioctl == KVM_SET_REG_BATCH);
+	}
 	case KVM_GET_REG_LIST: {
 		struct kvm_reg_list __user *user_list = argp;
 		struct kvm_reg_list reg_list;
@@ -870,9 +1250,72 @@ long kvm_arch_vcpu_ioctl(struct file *filp,
 	}
 }
 
+/**
+ * kvm_vm_ioctl_get_dirty_log - get and clear the log of dirty pages in a slot
+ * @kvm:	The VM pointer
+ * @log:	The slot and user space buffer to copy the dirty bitmap into
+ *
+ * The dirty bitmap is harvested word by word, and only the pages found dirty
+ * are write protected again, so that the next write to any of them is
+ * logged. The second half of the bitmap allocation is used as a bounce
+ * buffer for the copy to user space.
+ */
 int kvm_vm_ioctl_get_dirty_log(struct kvm *kvm, struct kvm_dirty_log *log)
 {
-	return -EINVAL;
+	int r;
+	struct kvm_memory_slot *memslot;
+	unsigned long n, i;
+	unsigned long *dirty_bitmap;
+	unsigned long *dirty_bitmap_buffer;
+	bool is_dirty = false;
+
+	mutex_lock(&kvm->slots_lock);
+
+	r = -EINVAL;
+	if (log->slot >= KVM_MEMORY_SLOTS)
+		goto out;
+
+	memslot = id_to_memslot(kvm->memslots, log->slot);
+
+	dirty_bitmap = memslot->dirty_bitmap;
+	r = -ENOENT;
+	if (!dirty_bitmap)
+		goto out;
+
+	n = kvm_dirty_bitmap_bytes(memslot);
+
+	dirty_bitmap_buffer = dirty_bitmap + n / sizeof(long);
+	memset(dirty_bitmap_buffer, 0, n);
+
+	spin_lock(&kvm->mmu_lock);
+
+	for (i = 0; i < n / sizeof(long); i++) {
+		unsigned long mask;
+
+		if (!dirty_bitmap[i])
+			continue;
+
+		is_dirty = true;
+
+		mask = xchg(&dirty_bitmap[i], 0);
+		dirty_bitmap_buffer[i] = mask;
+
+		kvm_mmu_write_protect_pt_masked(kvm, memslot,
+						i * BITS_PER_LONG, mask);
+	}
+	if (is_dirty)
+		kvm_tlb_flush_vmid(kvm);
+
+	spin_unlock(&kvm->mmu_lock);
+
+	r = -EFAULT;
+	if (copy_to_user(log->dirty_bitmap, dirty_bitmap_buffer, n))
+		goto out;
+
+	r = 0;
+out:
+	mutex_unlock(&kvm->slots_lock);
+	return r;
 }
 
 static int kvm_vm_ioctl_set_device_address(struct kvm *kvm,
@@ -907,6 +1350,10 @@ long kvm_arch_vm_ioctl(struct file *filp,
 		else
 			return -EINVAL;
 	}
+	case KVM_ARM_GET_VGIC_STATE:
+		return kvm_vgic_get_state(kvm, argp);
+	case KVM_ARM_SET_VGIC_STATE:
+		return kvm_vgic_set_state(kvm, argp);
 #endif
 	case KVM_SET_DEVICE_ADDRESS: {
 		struct kvm_device_address dev_addr;
@@ -1107,10 +1554,48 @@ void kvm_arch_exit(void)
 {
 }
 
+static int exit_latency_show(struct seq_file *m, void *v)
+{
+	u64 hist[KVM_ARM_EXIT_HIST_BUCKETS] = { 0 };
+	struct kvm_vcpu *vcpu;
+	struct kvm *kvm;
+	int i, b;
+
+	raw_spin_lock(&kvm_lock);
+	list_for_each_entry(kvm, &vm_list, vm_list)
+		kvm_for_each_vcpu(i, vcpu, kvm)
+			for (b = 0; b < KVM_ARM_EXIT_HIST_BUCKETS; b++)
+				hist[b] += vcpu->stat.exit_latency[b];
+	raw_spin_unlock(&kvm_lock);
+
+	kvm_arm_show_exit_latency(m, hist);
+	return 0;
+}
+
+static int exit_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, exit_latency_show, NULL);
+}
+
+static const struct file_operations exit_latency_fops = {
+	.open		= exit_latency_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int arm_init(void)
 {
 	int rc = kvm_init(NULL, sizeof(struct kvm_vcpu), 0, THIS_MODULE);
-	return rc;
+	if (rc)
+		return rc;
+
+	/* The histogram is optional, don't fail KVM if we can't expose it */
+	if (!debugfs_create_file("arm_exit_latency", 0444, kvm_debugfs_dir,
+				 NULL, &exit_latency_fops))
+		kvm_err("Cannot create exit latency debugfs file\n");
+
+	return 0;
 }
 
 module_init(arm_init);
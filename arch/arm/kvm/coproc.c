@@ -17,6 +17,7 @@
  * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 #include <linux/mm.h>
+#include <linux/hash.h>
 #include <linux/kvm_host.h>
 #include <linux/uaccess.h>
 #include <asm/kvm_arm.h>
@@ -227,9 +228,88 @@ static const struct coproc_reg cp15_regs[] = {
 /* Target specific emulation tables */
 static struct kvm_coproc_target_table *target_tables[KVM_ARM_NUM_TARGETS];
 
+/*
+ * Per-target open-addressing hash of the target-specific and generic
+ * cp15 tables, built when the target registers. A lookup is a hash of
+ * the encoding and usually a single compare, instead of a linear walk
+ * of both tables on every trap.
+ */
+#define CP15_INDEX_BITS		8
+#define CP15_INDEX_SIZE		(1 << CP15_INDEX_BITS)
+
+static const struct coproc_reg *cp15_index[KVM_ARM_NUM_TARGETS][CP15_INDEX_SIZE];
+
+static u32 cp15_index_hash(bool is_64, unsigned long CRn, unsigned long CRm,
+			   unsigned long Op1, unsigned long Op2)
+{
+	u32 key = ((u32)is_64 << 16) | (CRn << 12) | (CRm << 8) |
+		  (Op1 << 4) | Op2;
+
+	return hash_32(key, CP15_INDEX_BITS);
+}
+
+static bool coproc_reg_match(const struct coproc_params *params,
+			     const struct coproc_reg *r)
+{
+	return params->is_64bit == r->is_64 &&
+	       params->CRn == r->CRn &&
+	       params->CRm == r->CRm &&
+	       params->Op1 == r->Op1 &&
+	       params->Op2 == r->Op2;
+}
+
+static const struct coproc_reg *cp15_index_find(unsigned target,
+					const struct coproc_params *params)
+{
+	const struct coproc_reg **index = cp15_index[target];
+	const struct coproc_reg *r;
+	u32 i;
+
+	i = cp15_index_hash(params->is_64bit, params->CRn, params->CRm,
+			    params->Op1, params->Op2);
+	while ((r = index[i]) != NULL) {
+		if (coproc_reg_match(params, r))
+			return r;
+		i = (i + 1) & (CP15_INDEX_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+/* Insert @r unless an entry for the same register is already there. */
+static void cp15_index_add(unsigned target, const struct coproc_reg *r)
+{
+	const struct coproc_reg **index = cp15_index[target];
+	u32 i;
+
+	i = cp15_index_hash(r->is_64, r->CRn, r->CRm, r->Op1, r->Op2);
+	while (index[i]) {
+		if (index[i]->is_64 == r->is_64 && !cmp_reg(index[i], r))
+			return;
+		i = (i + 1) & (CP15_INDEX_SIZE - 1);
+	}
+
+	index[i] = r;
+}
+
+static void cp15_index_build(struct kvm_coproc_target_table *table)
+{
+	unsigned int i;
+
+	/* Keep the load factor low, so that probe chains stay short. */
+	BUG_ON(table->num + ARRAY_SIZE(cp15_regs) > CP15_INDEX_SIZE / 2);
+
+	/* Target-specific entries first, they override generic ones. */
+	for (i = 0; i < table->num; i++)
+		cp15_index_add(table->target, &table->table[i]);
+	for (i = 0; i < ARRAY_SIZE(cp15_regs); i++)
+		cp15_index_add(table->target, &cp15_regs[i]);
+}
+
 void kvm_register_target_coproc_table(struct kvm_coproc_target_table *table)
 {
 	target_tables[table->target] = table;
+	cp15_index_build(table);
 }
 
 /* Get specific register table for this target. */
@@ -251,18 +331,8 @@ static const struct coproc_reg *find_reg(const struct coproc_params *params,
 	for (i = 0; i < num; i++) {
 		const struct coproc_reg *r = &table[i];
 
-		if (params->is_64bit != r->is_64)
-			continue;
-		if (params->CRn != r->CRn)
-			continue;
-		if (params->CRm != r->CRm)
-			continue;
-		if (params->Op1 != r->Op1)
-			continue;
-		if (params->Op2 != r->Op2)
-			continue;
-
-		return r;
+		if (coproc_reg_match(params, r))
+			return r;
 	}
 	return NULL;
 }
@@ -270,18 +340,12 @@ static const struct coproc_reg *find_reg(const struct coproc_params *params,
 static int emulate_cp15(struct kvm_vcpu *vcpu,
 			const struct coproc_params *params)
 {
-	size_t num;
-	const struct coproc_reg *table, *r;
+	const struct coproc_reg *r;
 
 	trace_kvm_emulate_cp15_imp(params->Op1, params->Rt1, params->CRn,
 				   params->CRm, params->Op2, params->is_write);
 
-	table = get_target_table(vcpu->arch.target, &num);
-
-	/* Search target-specific then generic table. */
-	r = find_reg(params, table, num);
-	if (!r)
-		r = find_reg(params, cp15_regs, ARRAY_SIZE(cp15_regs));
+	r = cp15_index_find(vcpu->arch.target, params);
 
 	if (likely(r)) {
 		/* If we don't have an accessor, we should never get here! */
@@ -407,8 +471,7 @@ static bool index_to_params(u64 id, struct coproc_params *params)
 static const struct coproc_reg *index_to_coproc_reg(struct kvm_vcpu *vcpu,
 						    u64 id)
 {
-	size_t num;
-	const struct coproc_reg *table, *r;
+	const struct coproc_reg *r;
 	struct coproc_params params;
 
 	/* We only do cp15 for now. */
@@ -418,10 +481,7 @@ static const struct coproc_reg *index_to_coproc_reg(struct kvm_vcpu *vcpu,
 	if (!index_to_params(id, &params))
 		return NULL;
 
-	table = get_target_table(vcpu->arch.target, &num);
-	r = find_reg(&params, table, num);
-	if (!r)
-		r = find_reg(&params, cp15_regs, ARRAY_SIZE(cp15_regs));
+	r = cp15_index_find(vcpu->arch.target, &params);
 
 	/* Not saved in the cp15 array? */
 	if (r && !r->reg)
@@ -17,14 +17,37 @@
  */
 
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/kvm_host.h>
 #include <asm/kvm_arm.h>
 #include <asm/kvm_emulate.h>
 #include <asm/kvm_decode.h>
+#include <asm/kvm_vgic.h>
+#include <asm/kvm_arch_timer.h>
 #include <trace/events/kvm.h>
 
 #include "trace.h"
 
+#undef MODULE_PARAM_PREFIX
+#define MODULE_PARAM_PREFIX	"kvm_arm."
+
+/* Window a vCPU starts with once polling has been shown to pay off */
+#define HALT_POLL_NS_START	10000
+
+static unsigned int halt_poll_ns = 200000;
+module_param(halt_poll_ns, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns,
+		 "Maximum time a vcpu polls on WFI before blocking (0 disables)");
+
+static unsigned int halt_poll_ns_grow = 2;
+module_param(halt_poll_ns_grow, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns_grow, "Factor used to grow the WFI poll window");
+
+static unsigned int halt_poll_ns_shrink;
+module_param(halt_poll_ns_shrink, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns_shrink,
+		 "Divisor used to shrink the WFI poll window (0 resets it)");
+
 #define VCPU_NR_MODES 6
 #define REG_OFFSET(_reg) \
 	(offsetof(struct kvm_regs, _reg) / sizeof(u32))
@@ -155,19 +178,127 @@ u32 *vcpu_spsr(struct kvm_vcpu *vcpu)
 	}
 }
 
+static void grow_halt_poll_ns(struct kvm_vcpu *vcpu)
+{
+	unsigned int val = vcpu->arch.halt_poll_ns;
+
+	if (!halt_poll_ns_grow)
+		return;
+
+	if (!val)
+		val = HALT_POLL_NS_START;
+	else
+		val *= halt_poll_ns_grow;
+
+	vcpu->arch.halt_poll_ns = min(val, halt_poll_ns);
+}
+
+static void shrink_halt_poll_ns(struct kvm_vcpu *vcpu)
+{
+	if (!halt_poll_ns_shrink)
+		vcpu->arch.halt_poll_ns = 0;
+	else
+		vcpu->arch.halt_poll_ns /= halt_poll_ns_shrink;
+}
+
+/*
+ * Something that would end kvm_vcpu_block() straight away: an interrupt
+ * for the guest, a virtual timer that has reached its compare value but
+ * not been injected yet, or a signal for userspace.
+ */
+static bool kvm_vcpu_wfi_wakeup(struct kvm_vcpu *vcpu)
+{
+	return kvm_arch_vcpu_runnable(vcpu) ||
+	       kvm_timer_should_fire(vcpu) ||
+	       signal_pending(current);
+}
+
+/*
+ * Spin for up to the vcpu's current poll window waiting for a wakeup
+ * condition. Returns true if one showed up.
+ */
+static bool kvm_vcpu_poll_wfi(struct kvm_vcpu *vcpu, ktime_t start)
+{
+	s64 poll_ns = vcpu->arch.halt_poll_ns;
+
+	do {
+		if (kvm_vcpu_wfi_wakeup(vcpu))
+			return true;
+		cpu_relax();
+	} while (!need_resched() &&
+		 ktime_to_ns(ktime_sub(ktime_get(), start)) < poll_ns);
+
+	return false;
+}
+
+/*
+ * A guest spinning on WFE is most likely waiting for a lock held by a
+ * vcpu that has been preempted. Rather than burn the rest of our time
+ * slice, give it to a sibling vcpu that is runnable but not running.
+ * WFE may complete spuriously, so we simply skip the instruction and let
+ * the guest re-check its lock.
+ */
+static int kvm_handle_wfe(struct kvm_vcpu *vcpu)
+{
+	if (kvm_vcpu_on_spin(vcpu))
+		++vcpu->stat.wfe_yield;
+	else
+		++vcpu->stat.wfe_yield_fail;
+
+	kvm_skip_instr(vcpu, vcpu->arch.hsr & HSR_IL);
+	return 1;
+}
+
 /**
  * kvm_handle_wfi - handle a wait-for-interrupts instruction executed by a guest
  * @vcpu:	the vcpu pointer
  * @run:	the kvm_run structure pointer
  *
- * Simply sets the wait_for_interrupts flag on the vcpu structure, which will
- * halt execution of world-switches and schedule other host processes until
- * there is an incoming IRQ or FIQ to the VM.
+ * WFE traps share the exception class with WFI and are handed over to
+ * kvm_handle_wfe().
+ *
+ * For WFI, polls for a short, per-vcpu adaptive window before blocking the vcpu
+ * until there is an incoming IRQ or FIQ to the VM. Most wakeups arrive
+ * within a few tens of microseconds (IPIs, timer ticks, completed I/O),
+ * in which case polling saves a round-trip through the scheduler.
+ *
+ * The window grows when the vcpu blocked for less than the maximum
+ * window (polling longer would have caught the wakeup) and shrinks when
+ * it slept longer than that (polling was wasted time).
  */
 int kvm_handle_wfi(struct kvm_vcpu *vcpu, struct kvm_run *run)
 {
+	ktime_t start;
+	s64 block_ns;
+
 	trace_kvm_wfi(*vcpu_pc(vcpu));
+
+	if (vcpu->arch.hsr & HSR_WFI_IS_WFE)
+		return kvm_handle_wfe(vcpu);
+
+	start = ktime_get();
+	if (vcpu->arch.halt_poll_ns) {
+		if (kvm_vcpu_poll_wfi(vcpu, start)) {
+			++vcpu->stat.halt_poll_success;
+			return 1;
+		}
+		++vcpu->stat.halt_poll_fail;
+	}
+
+	kvm_timer_schedule(vcpu);
 	kvm_vcpu_block(vcpu);
+
+	if (!halt_poll_ns) {
+		vcpu->arch.halt_poll_ns = 0;
+		return 1;
+	}
+
+	block_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (block_ns > halt_poll_ns)
+		shrink_halt_poll_ns(vcpu);
+	else if (block_ns > vcpu->arch.halt_poll_ns)
+		grow_halt_poll_ns(vcpu);
+
 	return 1;
 }
 
@@ -176,8 +307,27 @@ static u64 kvm_va_to_pa(struct kvm_vcpu *vcpu, u32 va, bool priv)
 	return kvm_call_hyp(__kvm_va_to_pa, vcpu, va, priv);
 }
 
+/*
+ * Translate a guest VA through this vcpu's stage-1 context. Returns false
+ * if the guest has no valid mapping for it (anymore).
+ */
+static bool guest_va_to_ipa(struct kvm_vcpu *vcpu, unsigned long gva,
+			    bool priv, phys_addr_t *ipa)
+{
+	u64 par;
+
+	par = kvm_va_to_pa(vcpu, gva & PAGE_MASK, priv);
+	if (par & 1)
+		return false;
+
+	BUG_ON(!(par & (1U << 11)));
+	*ipa = par & PAGE_MASK & ((1ULL << 32) - 1);
+	*ipa += gva & ~PAGE_MASK;
+	return true;
+}
+
 /**
- * copy_from_guest_va - copy memory from guest (very slow!)
+ * copy_from_guest_va - copy memory from guest
  * @vcpu:	vcpu pointer
  * @dest:	memory to copy into
  * @gva:	virtual address in guest to copy from
@@ -185,87 +335,57 @@ static u64 kvm_va_to_pa(struct kvm_vcpu *vcpu, u32 va, bool priv)
  * @priv:	use guest PL1 (ie. kernel) mappings
  *              otherwise use guest PL0 mappings.
  *
+ * The translation and the read are separate steps, so another vcpu may
+ * remap @gva in between. Translate again after the read: if the mapping
+ * changed, we may have read stale memory and report a failure.
+ *
  * Returns true on success, false on failure (unlikely, but retry).
  */
 static bool copy_from_guest_va(struct kvm_vcpu *vcpu,
 			       void *dest, unsigned long gva, size_t len,
 			       bool priv)
 {
-	u64 par;
-	phys_addr_t pc_ipa;
+	phys_addr_t ipa, check;
 	int err;
 
 	BUG_ON((gva & PAGE_MASK) != ((gva + len) & PAGE_MASK));
-	par = kvm_va_to_pa(vcpu, gva & PAGE_MASK, priv);
-	if (par & 1) {
+	if (!guest_va_to_ipa(vcpu, gva, priv, &ipa)) {
 		kvm_err("IO abort from invalid instruction address"
 			" %#lx!\n", gva);
 		return false;
 	}
 
-	BUG_ON(!(par & (1U << 11)));
-	pc_ipa = par & PAGE_MASK & ((1ULL << 32) - 1);
-	pc_ipa += gva & ~PAGE_MASK;
-
-
-	err = kvm_read_guest(vcpu->kvm, pc_ipa, dest, len);
+	err = kvm_read_guest(vcpu->kvm, ipa, dest, len);
 	if (unlikely(err))
 		return false;
 
-	return true;
-}
+	if (!guest_va_to_ipa(vcpu, gva, priv, &check) || check != ipa)
+		return false;
 
-/* Just ensure we're not running the guest. */
-static void do_nothing(void *info)
-{
+	return true;
 }
 
 /*
- * We have to be very careful copying memory from a running (ie. SMP) guest.
- * Another CPU may remap the page (eg. swap out a userspace text page) as we
- * read the instruction.  Unlike normal hardware operation, to emulate an
- * instruction we map the virtual to physical address then read that memory
- * as separate steps, thus not atomic.
- *
- * Fortunately this is so rare (we don't usually need the instruction), we
- * can go very slowly and noone will mind.
+ * Fetch the instruction at the guest PC. Only the faulting vcpu is
+ * involved: it is not running, the hyp translation uses its own stage-1
+ * context, and copy_from_guest_va() detects a concurrent remapping by
+ * another vcpu. The other vcpus keep running.
  */
 static bool copy_current_insn(struct kvm_vcpu *vcpu, unsigned long *instr)
 {
-	int i;
 	bool ret;
-	struct kvm_vcpu *v;
 	bool is_thumb;
 	size_t instr_len;
 
-	/* Don't cross with IPIs in kvm_main.c */
-	spin_lock(&vcpu->kvm->mmu_lock);
-
-	/* Tell them all to pause, so no more will enter guest. */
-	kvm_for_each_vcpu(i, v, vcpu->kvm)
-		v->arch.pause = true;
-
-	/* Set ->pause before we read ->mode */
-	smp_mb();
-
-	/* Kick out any which are still running. */
-	kvm_for_each_vcpu(i, v, vcpu->kvm) {
-		/* Guest could exit now, making cpu wrong. That's OK. */
-		if (kvm_vcpu_exiting_guest_mode(v) == IN_GUEST_MODE)
-			smp_call_function_single(v->cpu, do_nothing, NULL, 1);
-	}
-
-
 	is_thumb = !!(*vcpu_cpsr(vcpu) & PSR_T_BIT);
 	instr_len = (is_thumb) ? 2 : 4;
 
 	BUG_ON(!is_thumb && *vcpu_pc(vcpu) & 0x3);
 
-	/* Now guest isn't running, we can va->pa map and copy atomically. */
 	ret = copy_from_guest_va(vcpu, instr, *vcpu_pc(vcpu), instr_len,
 				 vcpu_mode_priv(vcpu));
 	if (!ret)
-		goto out;
+		return false;
 
 	/* A 32-bit thumb2 instruction can actually go over a page boundary! */
 	if (is_thumb && is_wide_instruction(*instr)) {
@@ -274,13 +394,6 @@ static bool copy_current_insn(struct kvm_vcpu *vcpu, unsigned long *instr)
 					 vcpu_mode_priv(vcpu));
 	}
 
-out:
-	/* Release them all. */
-	kvm_for_each_vcpu(i, v, vcpu->kvm)
-		v->arch.pause = false;
-
-	spin_unlock(&vcpu->kvm->mmu_lock);
-
 	return ret;
 }
 
@@ -308,12 +421,12 @@ int kvm_emulate_mmio_ls(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa,
 	struct kvm_decode *decode = &vcpu->arch.mmio_decode;
 	int ret;
 
-	trace_kvm_mmio_emulate(*vcpu_pc(vcpu), instr, *vcpu_cpsr(vcpu));
-
 	/* If it fails (SMP race?), we reenter guest for it to retry. */
 	if (!copy_current_insn(vcpu, &instr))
 		return 1;
 
+	trace_kvm_mmio_emulate(*vcpu_pc(vcpu), instr, *vcpu_cpsr(vcpu));
+
 	mmio->phys_addr = fault_ipa;
 
 	memcpy(&current_regs, &vcpu->arch.regs.usr_regs, sizeof(current_regs));
@@ -32,6 +32,27 @@
 #define VCPU_STAT(x) { #x, offsetof(struct kvm_vcpu, stat.x), KVM_STAT_VCPU }
 
 struct kvm_stats_debugfs_item debugfs_entries[] = {
+	VCPU_STAT(halt_wakeup),
+	VCPU_STAT(halt_poll_success),
+	VCPU_STAT(halt_poll_fail),
+	VCPU_STAT(s2_block_map),
+	VCPU_STAT(s2_page_map),
+	VCPU_STAT(s2_access_fault),
+	VCPU_STAT(exit_irq),
+	VCPU_STAT(exit_wfi),
+	VCPU_STAT(exit_wfe),
+	VCPU_STAT(wfe_yield),
+	VCPU_STAT(wfe_yield_fail),
+	VCPU_STAT(exit_cp15),
+	VCPU_STAT(exit_cp14),
+	VCPU_STAT(exit_hvc),
+	VCPU_STAT(exit_smc),
+	VCPU_STAT(exit_s2_fault),
+	VCPU_STAT(exit_mmio_kernel),
+	VCPU_STAT(exit_mmio_user),
+	VCPU_STAT(vgic_maint_irq),
+	VCPU_STAT(vgic_lr_overflow),
+	VM_STAT(s2_premapped),
 	{ NULL }
 };
 
@@ -168,6 +189,64 @@ int kvm_arm_set_reg(struct kvm_vcpu *vcpu, const struct kvm_one_reg *reg)
 	return kvm_arm_coproc_set_reg(vcpu, reg);
 }
 
+/* Upper bound on a single KVM_GET/SET_REG_BATCH call */
+#define KVM_REG_BATCH_MAX	4096
+/* Entries handled per round of copy_from_user/copy_to_user */
+#define REG_BATCH_CHUNK		32
+
+/**
+ * kvm_arm_reg_batch - get or set a vector of registers
+ * @vcpu:	the vcpu pointer
+ * @batch:	register ids, per-entry error array and packed value buffer
+ * @set:	true for KVM_SET_REG_BATCH, false for KVM_GET_REG_BATCH
+ *
+ * Each entry is handled exactly like KVM_GET/SET_ONE_REG would, its value
+ * living at the next KVM_REG_SIZE-sized slot of the buffer, and its
+ * result stored in errors[]. A failed entry does not stop the batch.
+ *
+ * Returns the number of failed entries, or a negative error if the
+ * batch itself could not be processed.
+ */
+int kvm_arm_reg_batch(struct kvm_vcpu *vcpu, const struct kvm_reg_batch *batch,
+		      bool set)
+{
+	u64 __user *uids = (u64 __user *)(unsigned long)batch->ids;
+	s32 __user *uerrs = (s32 __user *)(unsigned long)batch->errors;
+	u64 addr = batch->addr;
+	u64 ids[REG_BATCH_CHUNK];
+	s32 errs[REG_BATCH_CHUNK];
+	unsigned int i, j, nr;
+	int failed = 0;
+
+	if (batch->n > KVM_REG_BATCH_MAX)
+		return -E2BIG;
+
+	for (i = 0; i < batch->n; i += nr) {
+		nr = min_t(u64, batch->n - i, REG_BATCH_CHUNK);
+		if (copy_from_user(ids, uids + i, nr * sizeof(*ids)))
+			return -EFAULT;
+
+		for (j = 0; j < nr; j++) {
+			struct kvm_one_reg reg = { .id = ids[j], .addr = addr };
+
+			if (set)
+				errs[j] = kvm_arm_set_reg(vcpu, &reg);
+			else
+				errs[j] = kvm_arm_get_reg(vcpu, &reg);
+			if (errs[j])
+				failed++;
+
+			addr += 1ULL << ((ids[j] & KVM_REG_SIZE_MASK) >>
+					 KVM_REG_SIZE_SHIFT);
+		}
+
+		if (copy_to_user(uerrs + i, errs, nr * sizeof(*errs)))
+			return -EFAULT;
+	}
+
+	return failed;
+}
+
 int kvm_arch_vcpu_ioctl_get_sregs(struct kvm_vcpu *vcpu,
 				  struct kvm_sregs *sregs)
 {
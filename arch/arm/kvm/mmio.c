@@ -149,9 +149,23 @@ int io_mem_abort(struct kvm_vcpu *vcpu, struct kvm_run *run,
 	if (mmio.is_write)
 		memcpy(mmio.data, vcpu_reg(vcpu, rt), mmio.len);
 
-	if (vgic_handle_mmio(vcpu, run, &mmio))
+	if (vgic_handle_mmio(vcpu, run, &mmio)) {
+		++vcpu->stat.exit_mmio_kernel;
 		return 1;
+	}
+
+	/*
+	 * Writes to an ioeventfd or to a coalesced MMIO zone complete in
+	 * the kernel, without a round trip to user space.
+	 */
+	if (mmio.is_write &&
+	    !kvm_io_bus_write(vcpu->kvm, KVM_MMIO_BUS, mmio.phys_addr,
+			      mmio.len, mmio.data)) {
+		++vcpu->stat.exit_mmio_kernel;
+		return 1;
+	}
 
+	++vcpu->stat.exit_mmio_user;
 	kvm_prepare_mmio(run, &mmio);
 	return 0;
 }
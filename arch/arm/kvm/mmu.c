@@ -19,6 +19,9 @@
 #include <linux/mman.h>
 #include <linux/kvm_host.h>
 #include <linux/io.h>
+#include <linux/hugetlb.h>
+#include <linux/module.h>
+#include <linux/log2.h>
 #include <trace/events/kvm.h>
 #include <asm/idmap.h>
 #include <asm/pgalloc.h>
@@ -33,10 +36,27 @@
 
 #include "trace.h"
 
+/* PMD_MASK is an unsigned long, which would truncate 40-bit IPAs */
+#define S2_PMD_MASK	(~((phys_addr_t)PMD_SIZE - 1))
+
+#undef MODULE_PARAM_PREFIX
+#define MODULE_PARAM_PREFIX	"kvm_arm."
+
+/*
+ * Maximum number of pages mapped around a faulting page. The window is
+ * naturally aligned and never crosses a level-3 table.
+ */
+#define KVM_FAULT_AROUND_MAX	64
+
+static unsigned int fault_around_pages;
+module_param(fault_around_pages, uint, 0644);
+MODULE_PARM_DESC(fault_around_pages,
+		 "Stage-2 fault-around window in pages (0 disables, max 64)");
+
 static DEFINE_MUTEX(kvm_hyp_pgd_mutex);
 static pgd_t *hyp_pgd;
 
-static void kvm_tlb_flush_vmid(struct kvm *kvm)
+void kvm_tlb_flush_vmid(struct kvm *kvm)
 {
 	kvm_call_hyp(__kvm_tlb_flush_vmid, kvm);
 }
@@ -51,6 +71,24 @@ static void kvm_set_pte(pte_t *pte, pte_t new_pte)
 	flush_pmd_entry(pte);
 }
 
+static void kvm_set_pmd(pmd_t *pmd, pmd_t new_pmd)
+{
+	pmd_val(*pmd) = new_pmd;
+	flush_pmd_entry(pmd);
+}
+
+/*
+ * Like pgd_addr_end() and friends, but for stage-2 IPAs which may not fit
+ * in an unsigned long.
+ */
+static phys_addr_t stage2_range_end(phys_addr_t addr, phys_addr_t end,
+				    phys_addr_t size)
+{
+	phys_addr_t boundary = (addr + size) & ~(size - 1);
+
+	return (boundary - 1 < end - 1) ? boundary : end;
+}
+
 static int mmu_topup_memory_cache(struct kvm_mmu_memory_cache *cache,
 				  int min, int max)
 {
@@ -344,37 +382,48 @@ static void unmap_stage2_range(struct kvm *kvm, phys_addr_t start, u64 size)
 	pmd_t *pmd;
 	pte_t *pte;
 	phys_addr_t addr = start, end = start + size;
-	u64 range;
+	phys_addr_t next;
 
 	while (addr < end) {
 		pgd = kvm->arch.pgd + pgd_index(addr);
 		pud = pud_offset(pgd, addr);
 		if (pud_none(*pud)) {
-			addr += PUD_SIZE;
+			addr = stage2_range_end(addr, end, PUD_SIZE);
 			continue;
 		}
 
 		pmd = pmd_offset(pud, addr);
 		if (pmd_none(*pmd)) {
-			addr += PMD_SIZE;
+			addr = stage2_range_end(addr, end, PMD_SIZE);
 			continue;
 		}
 
-		pte = pte_offset_kernel(pmd, addr);
-		clear_pte_entry(pte);
-		range = PAGE_SIZE;
+		if (pmd_sect(*pmd)) {
+			/* Block mappings go away as a whole */
+			pmd_clear(pmd);
+			put_page(virt_to_page(pmd));
+			next = stage2_range_end(addr, end, PMD_SIZE);
+		} else {
+			pte = pte_offset_kernel(pmd, addr);
+			clear_pte_entry(pte);
+			next = addr + PAGE_SIZE;
 
-		/* If we emptied the pte, walk back up the ladder */
-		if (pte_empty(pte)) {
-			clear_pmd_entry(pmd);
-			range = PMD_SIZE;
-			if (pmd_empty(pmd)) {
-				clear_pud_entry(pud);
-				range = PUD_SIZE;
+			/* If we emptied the pte, walk back up the ladder */
+			if (!pte_empty(pte)) {
+				addr = next;
+				continue;
 			}
+
+			clear_pmd_entry(pmd);
+			next = stage2_range_end(addr, end, PMD_SIZE);
 		}
 
-		addr += range;
+		if (pmd_empty(pmd)) {
+			clear_pud_entry(pud);
+			next = stage2_range_end(addr, end, PUD_SIZE);
+		}
+
+		addr = next;
 	}
 }
 
@@ -400,26 +449,87 @@ void kvm_free_stage2_pgd(struct kvm *kvm)
 }
 
 
-static int stage2_set_pte(struct kvm *kvm, struct kvm_mmu_memory_cache *cache,
-			  phys_addr_t addr, const pte_t *new_pte, bool iomap)
+static pmd_t *stage2_get_pmd(struct kvm *kvm, struct kvm_mmu_memory_cache *cache,
+			     phys_addr_t addr)
 {
 	pgd_t *pgd;
 	pud_t *pud;
 	pmd_t *pmd;
-	pte_t *pte, old_pte;
 
-	/* Create 2nd stage page table mapping - Level 1 */
 	pgd = kvm->arch.pgd + pgd_index(addr);
 	pud = pud_offset(pgd, addr);
 	if (pud_none(*pud)) {
 		if (!cache)
-			return 0; /* ignore calls from kvm_set_spte_hva */
+			return NULL; /* ignore calls from kvm_set_spte_hva */
 		pmd = mmu_memory_cache_alloc(cache);
 		pud_populate(NULL, pud, pmd);
-		pmd += pmd_index(addr);
 		get_page(virt_to_page(pud));
-	} else
-		pmd = pmd_offset(pud, addr);
+	}
+
+	return pmd_offset(pud, addr);
+}
+
+/*
+ * Tear down a level-3 table so that a block mapping can take its place.
+ * The level-2 entry is left empty.
+ */
+static void stage2_clear_pte_table(pmd_t *pmd)
+{
+	pte_t *pte = pte_offset_kernel(pmd, 0);
+	int i;
+
+	for (i = 0; i < PTRS_PER_PTE; i++)
+		clear_pte_entry(pte + i);
+
+	clear_pmd_entry(pmd);
+}
+
+static int stage2_set_pmd_huge(struct kvm *kvm,
+			       struct kvm_mmu_memory_cache *cache,
+			       phys_addr_t addr, const pmd_t *new_pmd)
+{
+	pmd_t *pmd, old_pmd;
+
+	pmd = stage2_get_pmd(kvm, cache, addr);
+	VM_BUG_ON(!pmd);
+
+	if (pmd_table(*pmd)) {
+		stage2_clear_pte_table(pmd);
+		kvm_tlb_flush_vmid(kvm);
+	}
+
+	old_pmd = *pmd;
+	kvm_set_pmd(pmd, *new_pmd);
+	if (pmd_sect(old_pmd))
+		kvm_tlb_flush_vmid(kvm);
+	else
+		get_page(virt_to_page(pmd));
+
+	return 0;
+}
+
+static int stage2_set_pte(struct kvm *kvm, struct kvm_mmu_memory_cache *cache,
+			  phys_addr_t addr, const pte_t *new_pte, bool iomap)
+{
+	pmd_t *pmd;
+	pte_t *pte, old_pte;
+
+	/* Create 2nd stage page table mapping - Level 1 */
+	pmd = stage2_get_pmd(kvm, cache, addr);
+	if (!pmd)
+		return 0;
+
+	/*
+	 * A block mapping is in the way: drop it and let the range be
+	 * faulted back in at page granularity.
+	 */
+	if (pmd_sect(*pmd)) {
+		if (!cache)
+			return 0; /* ignore calls from kvm_set_spte_hva */
+		pmd_clear(pmd);
+		kvm_tlb_flush_vmid(kvm);
+		put_page(virt_to_page(pmd));
+	}
 
 	/* Create 2nd stage page table mapping - Level 2 */
 	if (pmd_none(*pmd)) {
@@ -447,6 +557,177 @@ static int stage2_set_pte(struct kvm *kvm, struct kvm_mmu_memory_cache *cache,
 	return 0;
 }
 
+/*
+ * Return the level-3 entry mapping @addr, or NULL if the upper levels
+ * of the stage-2 tables are not populated or @addr is covered by a block
+ * mapping.
+ */
+static pte_t *stage2_get_pte(struct kvm *kvm, phys_addr_t addr)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = kvm->arch.pgd + pgd_index(addr);
+	pud = pud_offset(pgd, addr);
+	if (pud_none(*pud))
+		return NULL;
+
+	pmd = pmd_offset(pud, addr);
+	if (!pmd_table(*pmd))
+		return NULL;
+
+	return pte_offset_kernel(pmd, addr);
+}
+
+/*
+ * Find the leaf stage-2 entry mapping @addr: a block mapping is returned
+ * in *pmdp, a page mapping in *ptep. Return false if @addr isn't mapped.
+ */
+static bool stage2_get_leaf_entry(struct kvm *kvm, phys_addr_t addr,
+				  pmd_t **pmdp, pte_t **ptep)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	*pmdp = NULL;
+	*ptep = NULL;
+
+	pgd = kvm->arch.pgd + pgd_index(addr);
+	pud = pud_offset(pgd, addr);
+	if (pud_none(*pud))
+		return false;
+
+	pmd = pmd_offset(pud, addr);
+	if (pmd_sect(*pmd)) {
+		*pmdp = pmd;
+		return true;
+	}
+
+	if (!pmd_table(*pmd))
+		return false;
+
+	pte = pte_offset_kernel(pmd, addr);
+	if (!pte_present(*pte))
+		return false;
+
+	*ptep = pte;
+	return true;
+}
+
+static void stage2_wp_pte(pte_t *pte)
+{
+	if (pte_present(*pte) && (pte_val(*pte) & L_PTE_S2_RDWR))
+		kvm_set_pte(pte, __pte(pte_val(*pte) & ~L_PTE_S2_RDWR));
+}
+
+/**
+ * stage2_wp_range - write protect a range of stage-2 mappings
+ * @kvm:	The VM pointer
+ * @addr:	Start of the IPA range
+ * @end:	End of the IPA range (exclusive)
+ *
+ * Clears the stage-2 write permission on every mapped page in the range so
+ * that the next guest write to any of them takes a permission fault. Must
+ * be called with mmu_lock held; the caller is responsible for flushing the
+ * TLBs.
+ */
+static void stage2_wp_range(struct kvm *kvm, phys_addr_t addr, phys_addr_t end)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	phys_addr_t pud_end, next;
+
+	while (addr < end) {
+		pgd = kvm->arch.pgd + pgd_index(addr);
+		pud = pud_offset(pgd, addr);
+		pud_end = stage2_range_end(addr, end, PUD_SIZE);
+		if (pud_none(*pud)) {
+			addr = pud_end;
+			continue;
+		}
+
+		for (; addr < pud_end; addr = next) {
+			pmd = pmd_offset(pud, addr);
+			next = stage2_range_end(addr, pud_end, PMD_SIZE);
+			if (pmd_none(*pmd))
+				continue;
+
+			/*
+			 * Dirty pages are tracked at page granularity, so
+			 * block mappings are dropped and faulted back in as
+			 * pages.
+			 */
+			if (pmd_sect(*pmd)) {
+				pmd_clear(pmd);
+				put_page(virt_to_page(pmd));
+				if (pmd_empty(pmd)) {
+					clear_pud_entry(pud);
+					next = pud_end;
+				}
+				continue;
+			}
+
+			pte = pte_offset_kernel(pmd, addr);
+			for (; addr < next; addr += PAGE_SIZE, pte++)
+				stage2_wp_pte(pte);
+		}
+	}
+}
+
+/**
+ * kvm_mmu_wp_memory_region - write protect all stage-2 mappings of a slot
+ * @kvm:	The VM pointer
+ * @slot:	The memory slot id
+ *
+ * Called when dirty logging is enabled on a memory slot, so that every page
+ * the guest writes from now on is caught by user_mem_abort().
+ */
+void kvm_mmu_wp_memory_region(struct kvm *kvm, int slot)
+{
+	struct kvm_memory_slot *memslot = id_to_memslot(kvm->memslots, slot);
+	phys_addr_t start = (phys_addr_t)memslot->base_gfn << PAGE_SHIFT;
+	phys_addr_t end = start + ((phys_addr_t)memslot->npages << PAGE_SHIFT);
+
+	spin_lock(&kvm->mmu_lock);
+	stage2_wp_range(kvm, start, end);
+	kvm_tlb_flush_vmid(kvm);
+	spin_unlock(&kvm->mmu_lock);
+}
+
+/**
+ * kvm_mmu_write_protect_pt_masked - write protect a set of pages in a slot
+ * @kvm:	The VM pointer
+ * @slot:	The memory slot the pages belong to
+ * @gfn_offset:	Offset (in pages) of the first page in @mask from the slot base
+ * @mask:	Bitmap of pages to protect, as harvested from the dirty bitmap
+ *
+ * Only the pages reported dirty since the last call are re-protected. Must
+ * be called with mmu_lock held; the caller is responsible for flushing the
+ * TLBs.
+ */
+void kvm_mmu_write_protect_pt_masked(struct kvm *kvm,
+				     struct kvm_memory_slot *slot,
+				     gfn_t gfn_offset, unsigned long mask)
+{
+	phys_addr_t base = (phys_addr_t)(slot->base_gfn + gfn_offset) << PAGE_SHIFT;
+	pte_t *pte;
+
+	while (mask) {
+		phys_addr_t addr = base + ((phys_addr_t)__ffs(mask) << PAGE_SHIFT);
+
+		pte = stage2_get_pte(kvm, addr);
+		if (pte)
+			stage2_wp_pte(pte);
+
+		mask &= mask - 1;
+	}
+}
+
 /**
  * kvm_phys_addr_ioremap - map a device range to guest IPA
  *
@@ -486,7 +767,8 @@ out:
 	return ret;
 }
 
-static void coherent_icache_guest_page(struct kvm *kvm, gfn_t gfn)
+static void coherent_icache_guest_page(struct kvm *kvm, unsigned long hva,
+				       unsigned long size)
 {
 	/*
 	 * If we are going to insert an instruction page and the icache is
@@ -498,14 +780,208 @@ static void coherent_icache_guest_page(struct kvm *kvm, gfn_t gfn)
 	 * damn shame - as written in the ARM ARM (DDI 0406C - Page B3-1384)
 	 */
 	if (icache_is_pipt()) {
-		unsigned long hva = gfn_to_hva(kvm, gfn);
-		__cpuc_coherent_user_range(hva, hva + PAGE_SIZE);
+		__cpuc_coherent_user_range(hva, hva + size);
 	} else if (!icache_is_vivt_asid_tagged()) {
 		/* any kind of VIPT cache */
 		__flush_icache_all();
 	}
 }
 
+/*
+ * A block mapping can only be used if the whole block lies within the
+ * memslot, and if the IPA and the host virtual address have the same
+ * offset within a block (so that a huge host page maps to a block).
+ */
+static bool memslot_block_aligned(struct kvm_memory_slot *memslot,
+				  phys_addr_t fault_ipa)
+{
+	phys_addr_t slot_start = (phys_addr_t)memslot->base_gfn << PAGE_SHIFT;
+	phys_addr_t slot_end = slot_start +
+			       ((phys_addr_t)memslot->npages << PAGE_SHIFT);
+	phys_addr_t block_start = fault_ipa & S2_PMD_MASK;
+
+	if ((memslot->userspace_addr ^ slot_start) & ~PMD_MASK)
+		return false;
+
+	return block_start >= slot_start && block_start + PMD_SIZE <= slot_end;
+}
+
+static bool kvm_pfn_is_thp(pfn_t pfn)
+{
+	return pfn_valid(pfn) && PageTransCompound(pfn_to_page(pfn));
+}
+
+/*
+ * If the pfn is part of a transparent huge page, move the reference and
+ * the mapping over to the head of the block. Must be called with mmu_lock
+ * held and after a successful mmu_notifier_retry() check, so the huge page
+ * cannot be split from under us.
+ */
+static bool transparent_hugepage_adjust(pfn_t *pfnp, phys_addr_t *ipap)
+{
+	pfn_t pfn = *pfnp;
+	unsigned long mask = PTRS_PER_PMD - 1;
+
+	if (!kvm_pfn_is_thp(pfn))
+		return false;
+
+	VM_BUG_ON(((*ipap >> PAGE_SHIFT) & mask) != (pfn & mask));
+	if (pfn & mask) {
+		*ipap &= S2_PMD_MASK;
+		kvm_release_pfn_clean(pfn);
+		pfn &= ~mask;
+		kvm_get_pfn(pfn);
+		*pfnp = pfn;
+	}
+
+	return true;
+}
+
+/*
+ * Neighbouring pages which are already resident in the host, collected
+ * before taking mmu_lock and mapped along with the faulting page.
+ */
+struct fault_around {
+	gfn_t		base;
+	unsigned int	nr;
+	struct page	*pages[KVM_FAULT_AROUND_MAX];
+	DECLARE_BITMAP(writable, KVM_FAULT_AROUND_MAX);
+};
+
+static unsigned int fault_around_window(void)
+{
+	unsigned int nr = ACCESS_ONCE(fault_around_pages);
+
+	nr = min_t(unsigned int, nr, KVM_FAULT_AROUND_MAX);
+	return nr > 1 ? rounddown_pow_of_two(nr) : 0;
+}
+
+/**
+ * fault_around_collect - grab the resident neighbours of a faulting page
+ * @memslot:		The memory slot of the faulting gfn
+ * @gfn:		The faulting gfn, which is not collected
+ * @logging_active:	Neighbours are only mapped read-only when true
+ * @fa:			Where to store the pages
+ *
+ * Only pages which are already present in the host page tables are taken,
+ * so that we never allocate or swap in memory the guest did not touch.
+ * Each page returned has a reference which is dropped by
+ * fault_around_release(). Must be called after reading mmu_notifier_seq,
+ * so that an invalidation racing with us is caught by mmu_notifier_retry().
+ */
+static void fault_around_collect(struct kvm_memory_slot *memslot, gfn_t gfn,
+				 bool logging_active, struct fault_around *fa)
+{
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma = NULL;
+	unsigned int i, window = fault_around_window();
+	gfn_t start, end;
+
+	fa->nr = 0;
+	if (!window)
+		return;
+
+	start = max(gfn & ~((gfn_t)window - 1), memslot->base_gfn);
+	end = min((gfn | (window - 1)) + 1,
+		  memslot->base_gfn + memslot->npages);
+	fa->base = start;
+	bitmap_zero(fa->writable, KVM_FAULT_AROUND_MAX);
+
+	down_read(&mm->mmap_sem);
+	for (i = 0; start + i < end; i++) {
+		unsigned long hva = gfn_to_hva_memslot(memslot, start + i);
+		struct page *page;
+
+		fa->pages[i] = NULL;
+		if (start + i == gfn)
+			continue;
+
+		if (!vma || hva < vma->vm_start || hva >= vma->vm_end)
+			vma = find_vma_intersection(mm, hva, hva + 1);
+		if (!vma || (vma->vm_flags & (VM_IO | VM_PFNMAP)) ||
+		    is_vm_hugetlb_page(vma))
+			continue;
+
+		if (!logging_active && (vma->vm_flags & VM_WRITE)) {
+			page = follow_page(vma, hva, FOLL_GET | FOLL_WRITE);
+			if (!IS_ERR_OR_NULL(page)) {
+				fa->pages[i] = page;
+				set_bit(i, fa->writable);
+				continue;
+			}
+		}
+
+		page = follow_page(vma, hva, FOLL_GET);
+		if (!IS_ERR_OR_NULL(page))
+			fa->pages[i] = page;
+	}
+	fa->nr = i;
+	up_read(&mm->mmap_sem);
+
+	/* VIPT icaches have already been invalidated as a whole */
+	if (icache_is_pipt()) {
+		for (i = 0; i < fa->nr; i++) {
+			unsigned long hva;
+
+			if (!fa->pages[i])
+				continue;
+			hva = gfn_to_hva_memslot(memslot, start + i);
+			__cpuc_coherent_user_range(hva, hva + PAGE_SIZE);
+		}
+	}
+}
+
+/*
+ * Map the collected neighbours which don't have a stage-2 mapping yet.
+ * The window never crosses a level-3 table, and the table has just been
+ * populated for the faulting page, so no allocation is needed. Must be
+ * called with mmu_lock held, after a successful mmu_notifier_retry().
+ */
+static void fault_around_map(struct kvm *kvm, struct fault_around *fa)
+{
+	unsigned int i, mapped = 0;
+
+	for (i = 0; i < fa->nr; i++) {
+		phys_addr_t ipa = (phys_addr_t)(fa->base + i) << PAGE_SHIFT;
+		pfn_t pfn;
+		pte_t *pte, new_pte;
+
+		if (!fa->pages[i])
+			continue;
+
+		pte = stage2_get_pte(kvm, ipa);
+		if (!pte || pte_present(*pte))
+			continue;
+
+		pfn = page_to_pfn(fa->pages[i]);
+		new_pte = pfn_pte(pfn, PAGE_S2);
+		if (test_bit(i, fa->writable)) {
+			pte_val(new_pte) |= L_PTE_S2_RDWR;
+			kvm_set_pfn_dirty(pfn);
+		}
+
+		/* The entry was invalid, so there is nothing to flush */
+		kvm_set_pte(pte, new_pte);
+		get_page(virt_to_page(pte));
+		mapped++;
+	}
+
+	/*
+	 * This counts pages mapped ahead, not faults avoided: a page the
+	 * guest never touches is counted all the same.
+	 */
+	kvm->stat.s2_premapped += mapped;
+}
+
+static void fault_around_release(struct fault_around *fa)
+{
+	unsigned int i;
+
+	for (i = 0; i < fa->nr; i++)
+		if (fa->pages[i])
+			put_page(fa->pages[i]);
+}
+
 static int user_mem_abort(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa,
 			  gfn_t gfn, struct kvm_memory_slot *memslot,
 			  bool is_iabt, unsigned long fault_status)
@@ -514,8 +990,13 @@ static int user_mem_abort(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa,
 	pfn_t pfn;
 	int ret;
 	bool write_fault, writable;
+	bool hugetlb = false, thp = false, force_pte;
+	bool logging_active = memslot->flags & KVM_MEM_LOG_DIRTY_PAGES;
 	unsigned long mmu_seq;
+	unsigned long hva, map_size = PAGE_SIZE;
+	struct vm_area_struct *vma;
 	struct kvm_mmu_memory_cache *memcache = &vcpu->arch.mmu_page_cache;
+	struct fault_around fa;
 
 	if (is_iabt)
 		write_fault = false;
@@ -529,6 +1010,22 @@ static int user_mem_abort(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa,
 		return -EFAULT;
 	}
 
+	/* Dirty logging needs page granularity */
+	force_pte = logging_active || !memslot_block_aligned(memslot, fault_ipa);
+
+	/* Is the fault backed by a hugetlbfs page the size of a block? */
+	hva = gfn_to_hva_memslot(memslot, gfn);
+	if (!force_pte) {
+		down_read(&current->mm->mmap_sem);
+		vma = find_vma_intersection(current->mm, hva, hva + 1);
+		if (vma && is_vm_hugetlb_page(vma) &&
+		    vma_kernel_pagesize(vma) == PMD_SIZE) {
+			hugetlb = true;
+			gfn = (fault_ipa & S2_PMD_MASK) >> PAGE_SHIFT;
+		}
+		up_read(&current->mm->mmap_sem);
+	}
+
 	/* We need minimum second+third level pages */
 	ret = mmu_topup_memory_cache(memcache, 2, KVM_NR_MEM_OBJS);
 	if (ret)
@@ -541,24 +1038,102 @@ static int user_mem_abort(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa,
 	if (is_error_pfn(pfn))
 		return -EFAULT;
 
-	new_pte = pfn_pte(pfn, PAGE_S2);
-	coherent_icache_guest_page(vcpu->kvm, gfn);
+	/*
+	 * The icache maintenance cannot be done under mmu_lock, so a
+	 * transparent huge page is detected here, and confirmed with the
+	 * lock held. If it has been split in between, we simply end up
+	 * with a page mapping.
+	 */
+	if (!force_pte && !hugetlb)
+		thp = kvm_pfn_is_thp(pfn);
+	if (hugetlb || thp)
+		map_size = PMD_SIZE;
+	coherent_icache_guest_page(vcpu->kvm, hva & ~(map_size - 1), map_size);
+
+	/* Block mappings already cover the neighbourhood */
+	if (hugetlb || thp)
+		fa.nr = 0;
+	else
+		fault_around_collect(memslot, gfn, logging_active, &fa);
 
 	spin_lock(&vcpu->kvm->mmu_lock);
 	if (mmu_notifier_retry(vcpu->kvm, mmu_seq))
 		goto out_unlock;
-	if (writable) {
+
+	if (thp)
+		thp = transparent_hugepage_adjust(&pfn, &fault_ipa);
+
+	new_pte = pfn_pte(pfn, PAGE_S2);
+
+	/*
+	 * While dirty logging is active, only grant write access on an
+	 * actual write fault, so that every write to a clean page is seen
+	 * here and recorded in the dirty bitmap.
+	 */
+	if (writable && (write_fault || !logging_active)) {
 		pte_val(new_pte) |= L_PTE_S2_RDWR;
 		kvm_set_pfn_dirty(pfn);
 	}
-	stage2_set_pte(vcpu->kvm, memcache, fault_ipa, &new_pte, false);
+
+	if (hugetlb || thp) {
+		pmd_t new_pmd;
+
+		new_pmd = __pmd((pte_val(new_pte) & ~PMD_TYPE_MASK) |
+				PMD_TYPE_SECT);
+		stage2_set_pmd_huge(vcpu->kvm, memcache,
+				    fault_ipa & S2_PMD_MASK, &new_pmd);
+		vcpu->stat.s2_block_map++;
+	} else {
+		stage2_set_pte(vcpu->kvm, memcache, fault_ipa, &new_pte, false);
+		vcpu->stat.s2_page_map++;
+		fault_around_map(vcpu->kvm, &fa);
+	}
+
+	if (logging_active && write_fault)
+		mark_page_dirty_in_slot(vcpu->kvm, memslot, gfn);
 
 out_unlock:
 	spin_unlock(&vcpu->kvm->mmu_lock);
+	fault_around_release(&fa);
 	kvm_release_pfn_clean(pfn);
 	return 0;
 }
 
+/*
+ * The guest touched a page whose access flag was cleared by kvm_age_hva().
+ * Set the flag again, and let the host know the page is in use. If the
+ * mapping went away in the meantime, the guest simply faults it back in.
+ */
+static void handle_access_fault(struct kvm_vcpu *vcpu, phys_addr_t fault_ipa)
+{
+	pmd_t *pmd;
+	pte_t *pte;
+	pfn_t pfn;
+
+	trace_kvm_access_fault(fault_ipa);
+	++vcpu->stat.s2_access_fault;
+
+	spin_lock(&vcpu->kvm->mmu_lock);
+
+	if (!stage2_get_leaf_entry(vcpu->kvm, fault_ipa, &pmd, &pte)) {
+		spin_unlock(&vcpu->kvm->mmu_lock);
+		return;
+	}
+
+	/* Entries faulting on the access flag are not held in the TLBs */
+	if (pmd) {
+		kvm_set_pmd(pmd, __pmd(pmd_val(*pmd) | PMD_SECT_AF));
+		pfn = pte_pfn(__pte(pmd_val(*pmd)));	/* head of the block */
+	} else {
+		kvm_set_pte(pte, __pte(pte_val(*pte) | L_PTE_YOUNG));
+		pfn = pte_pfn(*pte);
+	}
+
+	spin_unlock(&vcpu->kvm->mmu_lock);
+
+	kvm_set_pfn_accessed(pfn);
+}
+
 /**
  * kvm_handle_guest_abort - handles all 2nd stage aborts
  * @vcpu:	the VCPU pointer
@@ -579,7 +1154,7 @@ int kvm_handle_guest_abort(struct kvm_vcpu *vcpu, struct kvm_run *run)
 	struct kvm_memory_slot *memslot = NULL;
 	bool is_iabt;
 	gfn_t gfn;
-	int ret;
+	int ret, idx;
 
 	hsr_ec = vcpu->arch.hsr >> HSR_EC_SHIFT;
 	is_iabt = (hsr_ec == HSR_EC_IABT);
@@ -588,42 +1163,63 @@ int kvm_handle_guest_abort(struct kvm_vcpu *vcpu, struct kvm_run *run)
 	trace_kvm_guest_fault(*vcpu_pc(vcpu), vcpu->arch.hsr,
 			      vcpu->arch.hxfar, fault_ipa);
 
-	/* Check the stage-2 fault is trans. fault or write fault */
+	/* Check the stage-2 fault is trans., access flag or write fault */
 	fault_status = (vcpu->arch.hsr & HSR_FSC_TYPE);
-	if (fault_status != FSC_FAULT && fault_status != FSC_PERM) {
+	if (fault_status != FSC_FAULT && fault_status != FSC_ACCESS &&
+	    fault_status != FSC_PERM) {
 		kvm_err("Unsupported fault status: EC=%#lx DFCS=%#lx\n",
 			hsr_ec, fault_status);
 		return -EFAULT;
 	}
 
+	/* Memslots and the MMIO bus are both protected by kvm->srcu */
+	idx = srcu_read_lock(&vcpu->kvm->srcu);
+
 	gfn = fault_ipa >> PAGE_SHIFT;
 	if (!kvm_is_visible_gfn(vcpu->kvm, gfn)) {
 		if (is_iabt) {
 			/* Prefetch Abort on I/O address */
 			kvm_inject_pabt(vcpu, vcpu->arch.hxfar);
-			return 1;
+			ret = 1;
+			goto out_unlock;
 		}
 
 		if (fault_status != FSC_FAULT) {
 			kvm_err("Unsupported fault status on io memory: %#lx\n",
 				fault_status);
-			return -EFAULT;
+			ret = -EFAULT;
+			goto out_unlock;
 		}
 
 		/* Adjust page offset */
 		fault_ipa |= vcpu->arch.hxfar & ~PAGE_MASK;
-		return io_mem_abort(vcpu, run, fault_ipa, memslot);
+		ret = io_mem_abort(vcpu, run, fault_ipa, memslot);
+		goto out_unlock;
 	}
 
 	memslot = gfn_to_memslot(vcpu->kvm, gfn);
 	if (!memslot->user_alloc) {
 		kvm_err("non user-alloc memslots not supported\n");
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	++vcpu->stat.exit_s2_fault;
+
+	if (fault_status == FSC_ACCESS) {
+		handle_access_fault(vcpu, fault_ipa);
+		ret = 1;
+		goto out_unlock;
 	}
 
 	ret = user_mem_abort(vcpu, fault_ipa, gfn, memslot,
 			     is_iabt, fault_status);
-	return ret ? ret : 1;
+	if (!ret)
+		ret = 1;
+
+out_unlock:
+	srcu_read_unlock(&vcpu->kvm->srcu, idx);
+	return ret;
 }
 
 static void handle_hva_to_gpa(struct kvm *kvm,
@@ -713,6 +1309,81 @@ void kvm_set_spte_hva(struct kvm *kvm, unsigned long hva, pte_t pte)
 	handle_hva_to_gpa(kvm, hva, end, &kvm_set_spte_handler, &stage2_pte);
 }
 
+/*
+ * Stage-2 mappings are created with the access flag set (PAGE_S2 includes
+ * L_PTE_YOUNG). Aging clears it, and as the flag is not managed by the
+ * hardware, the next guest access to the page takes an access flag fault
+ * which sets it again (see handle_access_fault()). The flag is at the same
+ * position in block and page descriptors.
+ */
+static void kvm_age_hva_handler(struct kvm *kvm, gpa_t gpa, void *data)
+{
+	int *young = data;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	if (!stage2_get_leaf_entry(kvm, gpa, &pmd, &pte))
+		return;
+
+	if (pmd) {
+		if (pmd_val(*pmd) & PMD_SECT_AF) {
+			kvm_set_pmd(pmd, __pmd(pmd_val(*pmd) & ~PMD_SECT_AF));
+			*young = 1;
+		}
+	} else if (pte_val(*pte) & L_PTE_YOUNG) {
+		kvm_set_pte(pte, __pte(pte_val(*pte) & ~L_PTE_YOUNG));
+		*young = 1;
+	}
+}
+
+static void kvm_test_age_hva_handler(struct kvm *kvm, gpa_t gpa, void *data)
+{
+	int *young = data;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	if (!stage2_get_leaf_entry(kvm, gpa, &pmd, &pte))
+		return;
+
+	if (pmd ? (pmd_val(*pmd) & PMD_SECT_AF) : (pte_val(*pte) & L_PTE_YOUNG))
+		*young = 1;
+}
+
+int kvm_age_hva(struct kvm *kvm, unsigned long hva)
+{
+	unsigned long end = hva + PAGE_SIZE;
+	int young = 0;
+
+	if (!kvm->arch.pgd)
+		return 0;
+
+	trace_kvm_age_hva(hva);
+	handle_hva_to_gpa(kvm, hva, end, &kvm_age_hva_handler, &young);
+
+	/*
+	 * The caller's kvm_flush_remote_tlbs() relies on vcpu requests,
+	 * which we don't process: flush here, or the old entry would keep
+	 * the guest from faulting on its next access.
+	 */
+	if (young)
+		kvm_tlb_flush_vmid(kvm);
+
+	return young;
+}
+
+int kvm_test_age_hva(struct kvm *kvm, unsigned long hva)
+{
+	unsigned long end = hva + PAGE_SIZE;
+	int young = 0;
+
+	if (!kvm->arch.pgd)
+		return 0;
+
+	trace_kvm_test_age_hva(hva);
+	handle_hva_to_gpa(kvm, hva, end, &kvm_test_age_hva_handler, &young);
+	return young;
+}
+
 void kvm_mmu_free_memory_caches(struct kvm_vcpu *vcpu)
 {
 	mmu_free_memory_cache(&vcpu->arch.mmu_page_cache);
@@ -27,7 +27,6 @@
 #include <asm/kvm_arch_timer.h>
 
 static struct timecounter *timecounter;
-static struct workqueue_struct *wqueue;
 
 static cycle_t kvm_phys_timer_read(void)
 {
@@ -58,60 +57,81 @@ static irqreturn_t kvm_arch_timer_handler(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
-static void kvm_timer_inject_irq_work(struct work_struct *work)
+/**
+ * kvm_timer_should_fire - check whether the guest timer has expired
+ * @vcpu:	the vcpu pointer
+ *
+ * Returns true if the virtual timer is enabled, unmasked and its
+ * compare value has been reached, regardless of whether the background
+ * timer has delivered the interrupt yet.
+ */
+bool kvm_timer_should_fire(struct kvm_vcpu *vcpu)
 {
-	struct kvm_vcpu *vcpu;
+	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
+	cycle_t now;
 
-	vcpu = container_of(work, struct kvm_vcpu, arch.timer_cpu.expired);
-	vcpu->arch.timer_cpu.armed = false;
-	kvm_timer_inject_irq(vcpu);
+	if ((timer->cntv_ctl & 3) != 1)
+		return false;
+
+	now = kvm_phys_timer_read() - vcpu->kvm->arch.timer.cntvoff;
+	return timer->cntv_cval <= now;
 }
 
+/*
+ * The background timer fires in hard interrupt context. Rather than
+ * taking the distributor lock from there (or bouncing through a
+ * workqueue), flag the interrupt as pending and wake the vcpu up: the
+ * interrupt is injected by kvm_timer_sync_to_cpu() on the way back into
+ * the guest.
+ */
 static enum hrtimer_restart kvm_timer_expire(struct hrtimer *hrt)
 {
 	struct arch_timer_cpu *timer;
+	struct kvm_vcpu *vcpu;
+
 	timer = container_of(hrt, struct arch_timer_cpu, timer);
-	queue_work(wqueue, &timer->expired);
+	vcpu = container_of(timer, struct kvm_vcpu, arch.timer_cpu);
+
+	timer->irq_pending = true;
+	smp_wmb();	/* pending flag visible before the vcpu wakes up */
+	kvm_vcpu_kick(vcpu);
+
 	return HRTIMER_NORESTART;
 }
 
-void kvm_timer_sync_to_cpu(struct kvm_vcpu *vcpu)
+/**
+ * kvm_timer_irq_pending - has the background timer fired?
+ * @vcpu:	the vcpu pointer
+ *
+ * Used by kvm_vcpu_block() to stop waiting once the guest timer expired.
+ */
+bool kvm_timer_irq_pending(struct kvm_vcpu *vcpu)
 {
-	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
-
-	/*
-	 * We're about to run this vcpu again, so there is no need to
-	 * keep the background timer running, as we're about to
-	 * populate the CPU timer again.
-	 */
-	if (timer->armed) {
-		hrtimer_cancel(&timer->timer);
-		cancel_work_sync(&timer->expired);
-		timer->armed = false;
-	}
+	return ACCESS_ONCE(vcpu->arch.timer_cpu.irq_pending);
 }
 
-void kvm_timer_sync_from_cpu(struct kvm_vcpu *vcpu)
+/**
+ * kvm_timer_schedule - arm the background timer before blocking
+ * @vcpu:	the vcpu pointer
+ *
+ * Only a blocked vcpu needs a host timer to wake it up. A vcpu that is
+ * merely out of the guest (preempted, in user space, ...) catches up with
+ * an expired timer in kvm_timer_sync_to_cpu().
+ */
+void kvm_timer_schedule(struct kvm_vcpu *vcpu)
 {
 	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
 	cycle_t cval, now;
 	u64 ns;
 
 	/* Check if the timer is enabled and unmasked first */
-	if ((timer->cntv_ctl & 3) != 1)
+	if ((timer->cntv_ctl & 3) != 1 || timer->armed)
 		return;
 
 	cval = timer->cntv_cval;
 	now = kvm_phys_timer_read() - vcpu->kvm->arch.timer.cntvoff;
-
-	BUG_ON(timer->armed);
-
 	if (cval <= now) {
-		/*
-		 * Timer has already expired while we were not
-		 * looking. Inject the interrupt and carry on.
-		 */
-		kvm_timer_inject_irq(vcpu);
+		timer->irq_pending = true;
 		return;
 	}
 
@@ -121,11 +141,48 @@ void kvm_timer_sync_from_cpu(struct kvm_vcpu *vcpu)
 		      HRTIMER_MODE_ABS);
 }
 
+void kvm_timer_sync_to_cpu(struct kvm_vcpu *vcpu)
+{
+	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
+
+	/*
+	 * We're about to run this vcpu again, so there is no need to
+	 * keep the background timer running, as we're about to
+	 * populate the CPU timer again.
+	 */
+	if (timer->armed) {
+		hrtimer_cancel(&timer->timer);
+		timer->armed = false;
+	}
+
+	/*
+	 * The background timer can't fire anymore: consume its pending
+	 * flag, or catch a timer that expired while we were out of the
+	 * guest without blocking.
+	 */
+	if (timer->irq_pending || kvm_timer_should_fire(vcpu)) {
+		timer->irq_pending = false;
+		kvm_timer_inject_irq(vcpu);
+	}
+}
+
+void kvm_timer_sync_from_cpu(struct kvm_vcpu *vcpu)
+{
+	BUG_ON(vcpu->arch.timer_cpu.armed);
+
+	/*
+	 * Timer has already expired while we were not looking. Inject
+	 * the interrupt and carry on. Otherwise, the background timer is
+	 * only armed if the vcpu blocks, see kvm_timer_schedule().
+	 */
+	if (kvm_timer_should_fire(vcpu))
+		kvm_timer_inject_irq(vcpu);
+}
+
 void kvm_timer_vcpu_init(struct kvm_vcpu *vcpu)
 {
 	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
 
-	INIT_WORK(&timer->expired, kvm_timer_inject_irq_work);
 	hrtimer_init(&timer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	timer->timer.function = kvm_timer_expire;
 }
@@ -173,12 +230,6 @@ int kvm_timer_hyp_init(void)
 		return err;
 	}
 
-	wqueue = create_singlethread_workqueue("kvm_arch_timer");
-	if (!wqueue) {
-		free_percpu_irq(ppi, kvm_get_running_vcpus());
-		return -ENOMEM;
-	}
-
 	kvm_info("%s IRQ%d\n", np->name, ppi);
 	on_each_cpu(kvm_timer_init_interrupt, &ppi, 1);
 
@@ -190,12 +241,11 @@ void kvm_timer_vcpu_terminate(struct kvm_vcpu *vcpu)
 	struct arch_timer_cpu *timer = &vcpu->arch.timer_cpu;
 
 	hrtimer_cancel(&timer->timer);
-	cancel_work_sync(&timer->expired);
 }
 
 int kvm_timer_init(struct kvm *kvm)
 {
-	if (timecounter && wqueue) {
+	if (timecounter) {
 		kvm->arch.timer.cntvoff = kvm_phys_timer_read();
 		kvm->arch.timer.enabled = 1;
 	}
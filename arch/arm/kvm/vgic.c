@@ -23,6 +23,10 @@
 #include <linux/of.h>
 #include <linux/of_address.h>
 #include <linux/of_irq.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uaccess.h>
+#include <trace/events/kvm.h>
 
 #include <asm/kvm_emulate.h>
 #include <asm/hardware/gic.h>
@@ -32,13 +36,18 @@
 /*
  * How the whole thing works (courtesy of Christoffer Dall):
  *
- * - At any time, the dist->irq_pending_on_cpu is the oracle that knows if
- *   something is pending
+ * - At any time, the VGIC_CPU_PENDING flag of each vcpu is the oracle
+ *   that knows if something is pending for it. The flags live in the
+ *   vcpus, so that injecting on one vcpu doesn't bounce a shared cache
+ *   line with the others.
  * - VGIC pending interrupts are stored on the vgic.irq_state vgic
  *   bitmap (this bitmap is updated by both user land ioctls and guest
  *   mmio ops) and indicate the 'wire' state.
- * - Every time the bitmap changes, the irq_pending_on_cpu oracle is
- *   recalculated
+ * - Every time the bitmap changes, the VGIC_CPU_PENDING oracle is
+ *   updated. Register writes only touch the interrupts they cover (see
+ *   vgic_update_irq_pending), and only the vcpus which got a new pending
+ *   interrupt are kicked. The whole state is only recomputed when the
+ *   distributor is enabled.
  * - To calculate the oracle, we need info for each cpu from
  *   compute_pending_for_cpu, which considers:
  *   - PPI: dist->irq_state & dist->irq_enable
@@ -63,6 +72,20 @@
  * - When the interrupt is EOIed, the maintenance interrupt fires,
  *   and clears the corresponding bit in irq_active. This allow the
  *   interrupt line to be sampled again.
+ *
+ * Locking:
+ *
+ * - dist->lock protects the distributor configuration (enable, config,
+ *   priority and target registers) and everything related to SPIs.
+ * - Each vcpu's vgic_cpu->lock protects its banked SGI/PPI state in the
+ *   distributor (its irq_state/irq_active words and irq_sgi_sources),
+ *   its pending bitmaps, and the LRs while they are being filled.
+ * - The vcpu lock nests inside dist->lock, and no more than one vcpu
+ *   lock is ever held at a time.
+ *
+ * SGIs, PPIs and the LR sync of a vcpu with no SPI in flight only take
+ * vcpu locks, so that an IPI sent to one vcpu doesn't contend with the
+ * other vcpus entering the guest.
  */
 
 #define VGIC_ADDR_UNDEF		(-1)
@@ -89,6 +112,8 @@ static struct device_node *vgic_node;
 #define ACCESS_WRITE_MASK(x)	((x) & (3 << 1))
 
 static void vgic_update_state(struct kvm *kvm);
+static void __vgic_update_irq_pending(struct kvm_vcpu *vcpu, int irq);
+static void vgic_update_irq_pending(struct kvm *kvm, int vcpu_id, int irq);
 static void vgic_kick_vcpus(struct kvm *kvm);
 static void vgic_dispatch_sgi(struct kvm_vcpu *vcpu, u32 reg);
 
@@ -113,6 +138,20 @@ static inline void kvm_vgic_vcpu_clear_pending_irq(struct kvm_vcpu *vcpu, int ir
 		clear_bit(irq - 32, vcpu->arch.vgic_cpu.pending_shared);
 }
 
+static inline bool vgic_spi_pending(struct vgic_cpu *vgic_cpu)
+{
+	return find_first_bit(vgic_cpu->pending_shared,
+			      VGIC_NR_SHARED_IRQS) < VGIC_NR_SHARED_IRQS;
+}
+
+/* Flag @vcpu as having something pending, and as needing a kick if @kick */
+static inline void vgic_cpu_set_pending(struct kvm_vcpu *vcpu, bool kick)
+{
+	set_bit(VGIC_CPU_PENDING, &vcpu->arch.vgic_cpu.flags);
+	if (kick)
+		set_bit(VGIC_CPU_KICK, &vcpu->arch.vgic_cpu.flags);
+}
+
 /**
  * vgic_reg_access - access vgic register
  * @mmio:   pointer to the data describing the mmio access
@@ -176,6 +215,38 @@ static void vgic_reg_access(struct kvm_exit_mmio *mmio, u32 *reg,
 	}
 }
 
+/*
+ * The first word of the one-bit-per-interrupt registers is the accessing
+ * vcpu's banked SGI/PPI copy, which injection and LR sync update under
+ * the vcpu lock only.
+ */
+static void vgic_lock_banked(struct kvm_vcpu *vcpu, u32 offset)
+{
+	if (offset < 4)
+		spin_lock(&vcpu->arch.vgic_cpu.lock);
+}
+
+static void vgic_unlock_banked(struct kvm_vcpu *vcpu, u32 offset)
+{
+	if (offset < 4)
+		spin_unlock(&vcpu->arch.vgic_cpu.lock);
+}
+
+/*
+ * Update the pending state of the interrupts whose bit changed in the
+ * 32bit register at @offset of a one-bit-per-interrupt register range.
+ */
+static void vgic_update_reg_pending(struct kvm_vcpu *vcpu, u32 offset,
+				    u32 changed)
+{
+	unsigned long bits = changed;
+	int irq_base = (offset & ~3U) * 8;
+	int i;
+
+	for_each_set_bit(i, &bits, 32)
+		vgic_update_irq_pending(vcpu->kvm, vcpu->vcpu_id, irq_base + i);
+}
+
 static bool handle_mmio_misc(struct kvm_vcpu *vcpu,
 			     struct kvm_exit_mmio *mmio, u32 offset)
 {
@@ -224,10 +295,17 @@ static bool handle_mmio_set_enable_reg(struct kvm_vcpu *vcpu,
 {
 	u32 *reg = vgic_bitmap_get_reg(&vcpu->kvm->arch.vgic.irq_enabled,
 				       vcpu->vcpu_id, offset);
+	u32 old, changed;
+
+	vgic_lock_banked(vcpu, offset);
+	old = *reg;
 	vgic_reg_access(mmio, reg, offset,
 			ACCESS_READ_VALUE | ACCESS_WRITE_SETBIT);
+	changed = old ^ *reg;
+	vgic_unlock_banked(vcpu, offset);
+
 	if (mmio->is_write) {
-		vgic_update_state(vcpu->kvm);
+		vgic_update_reg_pending(vcpu, offset, changed);
 		return true;
 	}
 
@@ -239,12 +317,19 @@ static bool handle_mmio_clear_enable_reg(struct kvm_vcpu *vcpu,
 {
 	u32 *reg = vgic_bitmap_get_reg(&vcpu->kvm->arch.vgic.irq_enabled,
 				       vcpu->vcpu_id, offset);
+	u32 old, changed;
+
+	vgic_lock_banked(vcpu, offset);
+	old = *reg;
 	vgic_reg_access(mmio, reg, offset,
 			ACCESS_READ_VALUE | ACCESS_WRITE_CLEARBIT);
+	if (mmio->is_write && offset < 4) /* Force SGI enabled */
+		*reg |= 0xffff;
+	changed = old ^ *reg;
+	vgic_unlock_banked(vcpu, offset);
+
 	if (mmio->is_write) {
-		if (offset < 4) /* Force SGI enabled */
-			*reg |= 0xffff;
-		vgic_update_state(vcpu->kvm);
+		vgic_update_reg_pending(vcpu, offset, changed);
 		return true;
 	}
 
@@ -256,10 +341,17 @@ static bool handle_mmio_set_pending_reg(struct kvm_vcpu *vcpu,
 {
 	u32 *reg = vgic_bitmap_get_reg(&vcpu->kvm->arch.vgic.irq_state,
 				       vcpu->vcpu_id, offset);
+	u32 old, changed;
+
+	vgic_lock_banked(vcpu, offset);
+	old = *reg;
 	vgic_reg_access(mmio, reg, offset,
 			ACCESS_READ_VALUE | ACCESS_WRITE_SETBIT);
+	changed = old ^ *reg;
+	vgic_unlock_banked(vcpu, offset);
+
 	if (mmio->is_write) {
-		vgic_update_state(vcpu->kvm);
+		vgic_update_reg_pending(vcpu, offset, changed);
 		return true;
 	}
 
@@ -271,10 +363,17 @@ static bool handle_mmio_clear_pending_reg(struct kvm_vcpu *vcpu,
 {
 	u32 *reg = vgic_bitmap_get_reg(&vcpu->kvm->arch.vgic.irq_state,
 				       vcpu->vcpu_id, offset);
+	u32 old, changed;
+
+	vgic_lock_banked(vcpu, offset);
+	old = *reg;
 	vgic_reg_access(mmio, reg, offset,
 			ACCESS_READ_VALUE | ACCESS_WRITE_CLEARBIT);
+	changed = old ^ *reg;
+	vgic_unlock_banked(vcpu, offset);
+
 	if (mmio->is_write) {
-		vgic_update_state(vcpu->kvm);
+		vgic_update_reg_pending(vcpu, offset, changed);
 		return true;
 	}
 
@@ -314,12 +413,29 @@ static u32 vgic_get_target_reg(struct kvm *kvm, int irq)
 	return val;
 }
 
-static void vgic_set_target_reg(struct kvm *kvm, u32 val, int irq)
+/* Route SPI @spi (0-based) to vcpu @target, updating the target bitmaps */
+static void vgic_set_spi_target(struct kvm *kvm, int spi, int target)
 {
 	struct vgic_dist *dist = &kvm->arch.vgic;
 	struct kvm_vcpu *vcpu;
-	int i, c;
 	unsigned long *bmap;
+	int c;
+
+	dist->irq_spi_cpu[spi] = target;
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		bmap = vgic_bitmap_get_shared_map(&dist->irq_spi_target[c]);
+		if (c == target)
+			set_bit(spi, bmap);
+		else
+			clear_bit(spi, bmap);
+	}
+}
+
+static void vgic_set_target_reg(struct kvm *kvm, u32 val, int irq)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_vcpu *vcpu;
+	int i;
 	u32 target;
 
 	BUG_ON(irq & 3);
@@ -334,16 +450,23 @@ static void vgic_set_target_reg(struct kvm *kvm, u32 val, int irq)
 	 */
 	for (i = 0; i < 4; i++) {
 		int shift = i * 8;
+		u8 old_target = dist->irq_spi_cpu[irq + i];
+
 		target = ffs((val >> shift) & 0xffU);
 		target = target ? (target - 1) : 0;
-		dist->irq_spi_cpu[irq + i] = target;
-		kvm_for_each_vcpu(c, vcpu, kvm) {
-			bmap = vgic_bitmap_get_shared_map(&dist->irq_spi_target[c]);
-			if (c == target)
-				set_bit(irq + i, bmap);
-			else
-				clear_bit(irq + i, bmap);
+		if (target == old_target)
+			continue;
+
+		vgic_set_spi_target(kvm, irq + i, target);
+
+		/* Move the pending state over to the new target */
+		vcpu = kvm_get_vcpu(kvm, old_target);
+		if (vcpu) {
+			spin_lock(&vcpu->arch.vgic_cpu.lock);
+			clear_bit(irq + i, vcpu->arch.vgic_cpu.pending_shared);
+			spin_unlock(&vcpu->arch.vgic_cpu.lock);
 		}
+		vgic_update_irq_pending(kvm, target, irq + i + 32);
 	}
 }
 
@@ -368,7 +491,6 @@ static bool handle_mmio_target_reg(struct kvm_vcpu *vcpu,
 			ACCESS_READ_VALUE | ACCESS_WRITE_VALUE);
 	if (mmio->is_write) {
 		vgic_set_target_reg(vcpu->kvm, reg, offset & ~3U);
-		vgic_update_state(vcpu->kvm);
 		return true;
 	}
 
@@ -443,7 +565,6 @@ static bool handle_mmio_sgi_reg(struct kvm_vcpu *vcpu,
 			ACCESS_READ_RAZ | ACCESS_WRITE_VALUE);
 	if (mmio->is_write) {
 		vgic_dispatch_sgi(vcpu, reg);
-		vgic_update_state(vcpu->kvm);
 		return true;
 	}
 
@@ -456,6 +577,8 @@ struct mmio_range {
 	unsigned long len;
 	bool (*handle_mmio)(struct kvm_vcpu *vcpu, struct kvm_exit_mmio *mmio,
 			    u32 offset);
+	/* Only banked state is touched, under the vcpu locks: no dist->lock */
+	bool percpu_only;
 };
 
 static const struct mmio_range vgic_ranges[] = {
@@ -518,6 +641,7 @@ static const struct mmio_range vgic_ranges[] = {
 		.base		= 0xF00,
 		.len		= 4,
 		.handle_mmio	= handle_mmio_sgi_reg,
+		.percpu_only	= true,
 	},
 	{}
 };
@@ -570,10 +694,14 @@ bool vgic_handle_mmio(struct kvm_vcpu *vcpu, struct kvm_run *run,
 		return false;
 	}
 
-	spin_lock(&vcpu->kvm->arch.vgic.lock);
 	offset = mmio->phys_addr - range->base - base;
-	updated_state = range->handle_mmio(vcpu, mmio, offset);
-	spin_unlock(&vcpu->kvm->arch.vgic.lock);
+	if (range->percpu_only) {
+		updated_state = range->handle_mmio(vcpu, mmio, offset);
+	} else {
+		spin_lock(&dist->lock);
+		updated_state = range->handle_mmio(vcpu, mmio, offset);
+		spin_unlock(&dist->lock);
+	}
 	kvm_prepare_mmio(run, mmio);
 	kvm_handle_mmio_return(vcpu, run);
 
@@ -587,8 +715,7 @@ static void vgic_dispatch_sgi(struct kvm_vcpu *vcpu, u32 reg)
 {
 	struct kvm *kvm = vcpu->kvm;
 	struct vgic_dist *dist = &kvm->arch.vgic;
-	int nrcpus = atomic_read(&kvm->online_vcpus);
-	u8 target_cpus;
+	unsigned long target_cpus;
 	int sgi, mode, c, vcpu_id;
 
 	vcpu_id = vcpu->vcpu_id;
@@ -599,27 +726,37 @@ static void vgic_dispatch_sgi(struct kvm_vcpu *vcpu, u32 reg)
 
 	switch (mode) {
 	case 0:
-		if (!target_cpus)
-			return;
+		break;
 
 	case 1:
-		target_cpus = ((1 << nrcpus) - 1) & ~(1 << vcpu_id) & 0xff;
+		/* All but self, built from the vcpus which actually exist */
+		target_cpus = 0;
+		kvm_for_each_vcpu(c, vcpu, kvm)
+			if (c != vcpu_id)
+				set_bit(c, &target_cpus);
 		break;
 
 	case 2:
-		target_cpus = 1 << vcpu_id;
+		target_cpus = 1UL << vcpu_id;
 		break;
+
+	default:
+		return;
 	}
 
-	kvm_for_each_vcpu(c, vcpu, kvm) {
-		if (target_cpus & 1) {
-			/* Flag the SGI as pending */
-			vgic_bitmap_set_irq_val(&dist->irq_state, c, sgi, 1);
-			dist->irq_sgi_sources[c][sgi] |= 1 << vcpu_id;
-			kvm_debug("SGI%d from CPU%d to CPU%d\n", sgi, vcpu_id, c);
-		}
+	/* Only the targets' banked state is involved, see vgic_ranges */
+	for_each_set_bit(c, &target_cpus, VGIC_MAX_CPUS) {
+		vcpu = kvm_get_vcpu(kvm, c);
+		if (!vcpu)
+			continue;
 
-		target_cpus >>= 1;
+		/* Flag the SGI as pending */
+		spin_lock(&vcpu->arch.vgic_cpu.lock);
+		vgic_bitmap_set_irq_val(&dist->irq_state, c, sgi, 1);
+		dist->irq_sgi_sources[c][sgi] |= 1 << vcpu_id;
+		__vgic_update_irq_pending(vcpu, sgi);
+		spin_unlock(&vcpu->arch.vgic_cpu.lock);
+		kvm_debug("SGI%d from CPU%d to CPU%d\n", sgi, vcpu_id, c);
 	}
 }
 
@@ -659,20 +796,83 @@ static void vgic_update_state(struct kvm *kvm)
 	int c;
 
 	if (!dist->enabled) {
-		set_bit(0, &dist->irq_pending_on_cpu);
+		vcpu = kvm_get_vcpu(kvm, 0);
+		if (vcpu)
+			vgic_cpu_set_pending(vcpu, false);
 		return;
 	}
 
 	kvm_for_each_vcpu(c, vcpu, kvm) {
+		spin_lock(&vcpu->arch.vgic_cpu.lock);
 		if (compute_pending_for_cpu(vcpu)) {
 			pr_debug("CPU%d has pending interrupts\n", c);
-			set_bit(c, &dist->irq_pending_on_cpu);
+			vgic_cpu_set_pending(vcpu, true);
 		}
+		spin_unlock(&vcpu->arch.vgic_cpu.lock);
+	}
+}
+
+/*
+ * Incremental version of vgic_update_state(), for a single interrupt:
+ * recompute whether @irq is pending on @vcpu, and flag @vcpu for a kick
+ * if it just became pending. Must be called with the vcpu lock held, and
+ * with the distributor lock held as well for SPIs.
+ */
+static void __vgic_update_irq_pending(struct kvm_vcpu *vcpu, int irq)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+	unsigned long *pending;
+	int bit;
+
+	/* Everything gets recomputed when the distributor is enabled */
+	if (!dist->enabled)
+		return;
+
+	if (irq < 32) {
+		bit = irq;
+		pending = vgic_cpu->pending_percpu;
+	} else {
+		bit = irq - 32;
+		pending = vgic_cpu->pending_shared;
+	}
+
+	if (!vgic_bitmap_get_irq_val(&dist->irq_state, vcpu->vcpu_id, irq) ||
+	    !vgic_bitmap_get_irq_val(&dist->irq_enabled, vcpu->vcpu_id, irq)) {
+		clear_bit(bit, pending);
+		return;
 	}
+
+	if (!test_and_set_bit(bit, pending) ||
+	    !test_bit(VGIC_CPU_PENDING, &vgic_cpu->flags))
+		vgic_cpu_set_pending(vcpu, true);
+}
+
+/*
+ * Same as above, on the vcpu @irq targets (@vcpu_id for SGIs and PPIs).
+ * Must be called with distributor lock held.
+ */
+static void vgic_update_irq_pending(struct kvm *kvm, int vcpu_id, int irq)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_vcpu *vcpu;
+
+	if (irq >= 32)
+		vcpu_id = dist->irq_spi_cpu[irq - 32];
+
+	vcpu = kvm_get_vcpu(kvm, vcpu_id);
+	if (!vcpu)
+		return;
+
+	spin_lock(&vcpu->arch.vgic_cpu.lock);
+	__vgic_update_irq_pending(vcpu, irq);
+	spin_unlock(&vcpu->arch.vgic_cpu.lock);
 }
 
 #define LR_PHYSID(lr) 		(((lr) & VGIC_LR_PHYSID_CPUID) >> 10)
 #define MK_LR_PEND(src, irq)	(VGIC_LR_PENDING_BIT | ((src) << 10) | (irq))
+#define MK_LR_PRIO(prio)	((((prio) >> 3) << VGIC_LR_PRIORITY_SHIFT) & \
+				 VGIC_LR_PRIORITY)
 
 /*
  * An interrupt may have been disabled after being made pending on the
@@ -701,6 +901,82 @@ static void vgic_retire_disabled_irqs(struct kvm_vcpu *vcpu)
 	}
 }
 
+static u8 vgic_get_irq_priority(struct kvm_vcpu *vcpu, int irq)
+{
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+
+	return vgic_bytemap_get_irq_val(&dist->irq_priority, vcpu->vcpu_id, irq);
+}
+
+/*
+ * Give an LR back to the distributor: the interrupt it holds is made
+ * pending again, and will be queued on a later entry.
+ */
+static void vgic_unqueue_lr(struct kvm_vcpu *vcpu, int lr)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+	u32 val = vgic_cpu->vgic_lr[lr];
+	int irq = val & VGIC_LR_VIRTUALID;
+	int vcpu_id = vcpu->vcpu_id;
+
+	kvm_debug("LR%d evicted, IRQ%d back to the distributor\n", lr, irq);
+
+	if (irq < 16) {
+		dist->irq_sgi_sources[vcpu_id][irq] |= 1 << LR_PHYSID(val);
+		vgic_bitmap_set_irq_val(&dist->irq_state, vcpu_id, irq, 1);
+		kvm_vgic_vcpu_set_pending_irq(vcpu, irq);
+	} else if (irq < 32 || vgic_irq_is_edge(dist, irq)) {
+		vgic_bitmap_set_irq_val(&dist->irq_state, vcpu_id, irq, 1);
+		kvm_vgic_vcpu_set_pending_irq(vcpu, irq);
+	} else {
+		/* Level SPI: only pending if the line is still high */
+		vgic_bitmap_set_irq_val(&dist->irq_active, 0, irq, 0);
+		if (vgic_bitmap_get_irq_val(&dist->irq_state, 0, irq))
+			kvm_vgic_vcpu_set_pending_irq(vcpu, irq);
+		else
+			kvm_vgic_vcpu_clear_pending_irq(vcpu, irq);
+	}
+
+	if (val & VGIC_LR_EOI)
+		atomic_dec(&vgic_cpu->irq_active_count);
+
+	vgic_cpu->vgic_irq_lr_map[irq] = LR_EMPTY;
+	clear_bit(lr, vgic_cpu->lr_used);
+	vgic_cpu->vgic_lr[lr] &= ~VGIC_LR_STATE;
+}
+
+/*
+ * Find the lowest priority LR which is only pending (the guest hasn't
+ * acknowledged it yet) and has a lower priority than @prio, and hand it
+ * back to the distributor. Return the freed LR, or -1 if none qualifies.
+ */
+static int vgic_evict_lr(struct kvm_vcpu *vcpu, u8 prio)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	int lr, victim = -1;
+	u8 victim_prio = prio;
+
+	for_each_set_bit(lr, vgic_cpu->lr_used, vgic_cpu->nr_lr) {
+		u32 val = vgic_cpu->vgic_lr[lr];
+		u8 lr_prio;
+
+		if ((val & VGIC_LR_STATE) != VGIC_LR_PENDING_BIT)
+			continue;
+
+		lr_prio = vgic_get_irq_priority(vcpu, val & VGIC_LR_VIRTUALID);
+		if (lr_prio > victim_prio) {
+			victim = lr;
+			victim_prio = lr_prio;
+		}
+	}
+
+	if (victim >= 0)
+		vgic_unqueue_lr(vcpu, victim);
+
+	return victim;
+}
+
 /*
  * Queue an interrupt to a CPU virtual interface. Return true on success,
  * or false if it wasn't possible to queue it.
@@ -741,7 +1017,8 @@ static bool vgic_queue_irq(struct kvm_vcpu *vcpu, u8 sgi_source_id, int irq)
 		return false;
 
 	kvm_debug("LR%d allocated for IRQ%d %x\n", lr, irq, sgi_source_id);
-	vgic_cpu->vgic_lr[lr] = MK_LR_PEND(sgi_source_id, irq);
+	vgic_cpu->vgic_lr[lr] = MK_LR_PEND(sgi_source_id, irq) |
+				MK_LR_PRIO(vgic_get_irq_priority(vcpu, irq));
 	if (is_level) {
 		vgic_cpu->vgic_lr[lr] |= VGIC_LR_EOI;
 		atomic_inc(&vgic_cpu->irq_active_count);
@@ -754,108 +1031,170 @@ static bool vgic_queue_irq(struct kvm_vcpu *vcpu, u8 sgi_source_id, int irq)
 }
 
 /*
- * Fill the list registers with pending interrupts before running the
- * guest.
+ * Queue all the sources of a pending SGI. Return true if they could all
+ * be queued.
  */
-static void __kvm_vgic_sync_to_cpu(struct kvm_vcpu *vcpu)
+static bool vgic_queue_sgi(struct kvm_vcpu *vcpu, int irq)
 {
-	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
 	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
-	int i, c, vcpu_id;
-	int overflow = 0;
-
-	vcpu_id = vcpu->vcpu_id;
-
-	vgic_retire_disabled_irqs(vcpu);
+	int vcpu_id = vcpu->vcpu_id;
+	unsigned long sources;
+	int c;
 
-	/*
-	 * We may not have any pending interrupt, or the interrupts
-	 * may have been serviced from another vcpu. In all cases,
-	 * move along.
-	 */
-	if (!kvm_vgic_vcpu_pending_irq(vcpu)) {
-		pr_debug("CPU%d has no pending interrupt\n", vcpu_id);
-		goto epilog;
+	sources = dist->irq_sgi_sources[vcpu_id][irq];
+	for_each_set_bit(c, &sources, 8) {
+		if (vgic_queue_irq(vcpu, c, irq))
+			clear_bit(c, &sources);
 	}
 
-	/* SGIs */
-	for_each_set_bit(i, vgic_cpu->pending_percpu, 16) {
-		unsigned long sources;
+	dist->irq_sgi_sources[vcpu_id][irq] = sources;
+	if (sources)
+		return false;
 
-		sources = dist->irq_sgi_sources[vcpu_id][i];
-		for_each_set_bit(c, &sources, 8) {
-			if (!vgic_queue_irq(vcpu, c, i)) {
-				overflow = 1;
-				continue;
-			}
+	vgic_bitmap_set_irq_val(&dist->irq_state, vcpu_id, irq, 0);
+	kvm_vgic_vcpu_clear_pending_irq(vcpu, irq);
+	return true;
+}
 
-			clear_bit(c, &sources);
-		}
+/* Queue a pending PPI or SPI. Return true on success. */
+static bool vgic_queue_hwirq(struct kvm_vcpu *vcpu, int irq)
+{
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
 
-		if (!sources) {
-			vgic_bitmap_set_irq_val(&dist->irq_state, vcpu_id, i, 0);
-			kvm_vgic_vcpu_clear_pending_irq(vcpu, i);
-		}
+	if (!vgic_queue_irq(vcpu, 0, irq))
+		return false;
 
-		dist->irq_sgi_sources[vcpu_id][i] = sources;
+	/* Immediate clear on edge and PPIs, set active on level SPIs */
+	if (irq < 32 || vgic_irq_is_edge(dist, irq)) {
+		vgic_bitmap_set_irq_val(&dist->irq_state, vcpu->vcpu_id, irq, 0);
+		kvm_vgic_vcpu_clear_pending_irq(vcpu, irq);
+	} else {
+		vgic_bitmap_set_irq_val(&dist->irq_active, 0, irq, 1);
 	}
 
-	/* PPIs */
-	for_each_set_bit_from(i, vgic_cpu->pending_percpu, 32) {
-		if (!vgic_queue_irq(vcpu, 0, i)) {
-			overflow = 1;
-			continue;
-		}
+	return true;
+}
 
-		vgic_bitmap_set_irq_val(&dist->irq_state, vcpu_id, i, 0);
-		kvm_vgic_vcpu_clear_pending_irq(vcpu, i);
-	}
+/*
+ * Pending interrupts are sorted on a 16bit key made of the priority
+ * (most significant byte) and the interrupt number, so that the highest
+ * priority (lowest value) comes first, and equal priorities are served
+ * by interrupt number like the GIC does.
+ */
+#define VGIC_PEND_KEY(prio, irq)	(((prio) << 8) | (irq))
+#define VGIC_PEND_IRQ(key)		((key) & 0xff)
+#define VGIC_PEND_PRIO(key)		((key) >> 8)
+
+static int vgic_cmp_pending(const void *a, const void *b)
+{
+	return *(const u16 *)a - *(const u16 *)b;
+}
+
+static int vgic_sort_pending(struct kvm_vcpu *vcpu, u16 *pend, bool spi)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+	int i, nr = 0;
 
+	/* The sort key only has room for 8 bits of interrupt number */
+	BUILD_BUG_ON(VGIC_NR_IRQS > 256);
+
+	for_each_set_bit(i, vgic_cpu->pending_percpu, 32)
+		pend[nr++] = VGIC_PEND_KEY(vgic_get_irq_priority(vcpu, i), i);
+
+	/* SPIs can only be looked at with the distributor lock held */
+	if (!spi)
+		goto sort;
 
-	/* SPIs */
 	for_each_set_bit(i, vgic_cpu->pending_shared, VGIC_NR_SHARED_IRQS) {
 		int irq = i + 32;
+
 		if (vgic_bitmap_get_irq_val(&dist->irq_active, 0, irq))
 			continue; /* level interrupt, already queued */
 
-		if (!vgic_queue_irq(vcpu, 0, irq)) {
-			overflow = 1;
-			continue;
-		}
+		pend[nr++] = VGIC_PEND_KEY(vgic_get_irq_priority(vcpu, irq),
+					   irq);
+	}
 
-		/* Immediate clear on edge, set active on level */
-		if (vgic_irq_is_edge(dist, irq)) {
-			vgic_bitmap_set_irq_val(&dist->irq_state, 0, irq, 0);
-			kvm_vgic_vcpu_clear_pending_irq(vcpu, irq);
-		} else {
-			vgic_bitmap_set_irq_val(&dist->irq_active, 0, irq, 1);
+sort:
+	sort(pend, nr, sizeof(*pend), vgic_cmp_pending, NULL);
+	return nr;
+}
+
+/*
+ * Fill the list registers with pending interrupts before running the
+ * guest, highest priority first. When we run out of LRs, lower priority
+ * interrupts queued on a previous entry are evicted. SPIs are only
+ * considered if @spi, with the distributor lock held.
+ */
+static void __kvm_vgic_sync_to_cpu(struct kvm_vcpu *vcpu, bool spi)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	u16 pend[VGIC_NR_IRQS];
+	int i, nr, vcpu_id;
+	int overflow = 0;
+
+	vcpu_id = vcpu->vcpu_id;
+
+	vgic_retire_disabled_irqs(vcpu);
+
+	/*
+	 * We may not have any pending interrupt, or the interrupts
+	 * may have been serviced from another vcpu. In all cases,
+	 * move along.
+	 */
+	if (!kvm_vgic_vcpu_pending_irq(vcpu)) {
+		pr_debug("CPU%d has no pending interrupt\n", vcpu_id);
+		goto epilog;
+	}
+
+	nr = vgic_sort_pending(vcpu, pend, spi);
+	for (i = 0; i < nr; i++) {
+		int irq = VGIC_PEND_IRQ(pend[i]);
+
+		for (;;) {
+			if (irq < 16 ? vgic_queue_sgi(vcpu, irq) :
+				       vgic_queue_hwirq(vcpu, irq))
+				break;
+
+			/*
+			 * Out of LRs: make room by evicting a lower
+			 * priority interrupt, which is now pending in the
+			 * distributor again. Either way, we need to come
+			 * back once the guest has freed some LRs.
+			 */
+			overflow = 1;
+			if (vgic_evict_lr(vcpu, VGIC_PEND_PRIO(pend[i])) < 0)
+				break;
 		}
 	}
 
 epilog:
-	if (overflow)
+	if (overflow) {
+		++vcpu->stat.vgic_lr_overflow;
 		vgic_cpu->vgic_hcr |= VGIC_HCR_UIE;
-	else {
+	} else {
 		vgic_cpu->vgic_hcr &= ~VGIC_HCR_UIE;
 		/*
 		 * We're about to run this VCPU, and we've consumed
 		 * everything the distributor had in store for
 		 * us. Claim we don't have anything pending. We'll
-		 * adjust that if needed while exiting.
+		 * adjust that if needed while exiting. An SPI we didn't
+		 * look at is still pending, though.
 		 */
-		clear_bit(vcpu_id, &dist->irq_pending_on_cpu);
+		if (spi || !vgic_spi_pending(vgic_cpu))
+			clear_bit(VGIC_CPU_PENDING, &vgic_cpu->flags);
 	}
 }
 
 /*
  * Sync back the VGIC state after a guest run. We do not really touch
- * the distributor here (the irq_pending_on_cpu bit is safe to set),
+ * the distributor here (the VGIC_CPU_PENDING flag is safe to set),
  * so there is no need for taking its lock.
  */
 static void __kvm_vgic_sync_from_cpu(struct kvm_vcpu *vcpu)
 {
 	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
-	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
 	int lr, pending;
 
 	/* Clear mappings for empty LRs */
@@ -876,21 +1215,89 @@ static void __kvm_vgic_sync_from_cpu(struct kvm_vcpu *vcpu)
 	pending = find_first_zero_bit((unsigned long *)vgic_cpu->vgic_elrsr,
 				      vgic_cpu->nr_lr);
 	if (pending < vgic_cpu->nr_lr) {
-		set_bit(vcpu->vcpu_id, &dist->irq_pending_on_cpu);
+		set_bit(VGIC_CPU_PENDING, &vgic_cpu->flags);
 		smp_mb();
 	}
 }
 
+/* Does @vcpu have an SPI pending, or queued in one of its LRs? */
+static bool vgic_cpu_has_spi(struct kvm_vcpu *vcpu)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	int lr;
+
+	for_each_set_bit(lr, vgic_cpu->lr_used, vgic_cpu->nr_lr)
+		if ((vgic_cpu->vgic_lr[lr] & VGIC_LR_VIRTUALID) >= 32)
+			return true;
+
+	return vgic_spi_pending(vgic_cpu);
+}
+
 void kvm_vgic_sync_to_cpu(struct kvm_vcpu *vcpu)
 {
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
 	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+	bool spi;
 
 	if (!irqchip_in_kernel(vcpu->kvm))
 		return;
 
-	spin_lock(&dist->lock);
-	__kvm_vgic_sync_to_cpu(vcpu);
-	spin_unlock(&dist->lock);
+	/*
+	 * Nothing pending and no LR in use: there is nothing to queue or
+	 * retire, so don't take any lock. An interrupt made pending behind
+	 * our back is followed by a kick, exactly as if it had come right
+	 * after the locked path.
+	 */
+	if (!test_bit(VGIC_CPU_PENDING, &vgic_cpu->flags) &&
+	    find_first_bit(vgic_cpu->lr_used, vgic_cpu->nr_lr) >= vgic_cpu->nr_lr) {
+		vgic_cpu->vgic_hcr &= ~VGIC_HCR_UIE;
+		return;
+	}
+
+	/*
+	 * Only take the distributor lock if an SPI is pending or sits in
+	 * an LR. The LRs only change from this vcpu's own thread, and an
+	 * SPI made pending after this check is noticed under the vcpu lock
+	 * and left pending for the next entry.
+	 */
+	spi = vgic_cpu_has_spi(vcpu);
+	if (spi)
+		spin_lock(&dist->lock);
+	spin_lock(&vgic_cpu->lock);
+	__kvm_vgic_sync_to_cpu(vcpu, spi);
+	spin_unlock(&vgic_cpu->lock);
+	if (spi)
+		spin_unlock(&dist->lock);
+}
+
+/*
+ * Report the level-triggered SPIs EOIed by the guest to the ack notifiers
+ * (irqfd resamplers). This cannot be done from the maintenance interrupt
+ * handler, as the notifiers inject interrupts and take the distributor
+ * lock.
+ */
+static void vgic_notify_acked_irqs(struct kvm_vcpu *vcpu)
+{
+	struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
+	int spi;
+
+	for_each_set_bit(spi, vgic_cpu->eoied_shared, VGIC_NR_SHARED_IRQS) {
+		clear_bit(spi, vgic_cpu->eoied_shared);
+		kvm_notify_acked_irq(vcpu->kvm, 0, spi);
+
+		/*
+		 * The maintenance handler made the interrupt pending again
+		 * if its line was still high. Drop it if the notifier has
+		 * lowered the line in the meantime.
+		 */
+		spin_lock(&dist->lock);
+		spin_lock(&vgic_cpu->lock);
+		if (!vgic_bitmap_get_irq_val(&dist->irq_state, 0, spi + 32))
+			kvm_vgic_vcpu_clear_pending_irq(vcpu, spi + 32);
+		spin_unlock(&vgic_cpu->lock);
+		spin_unlock(&dist->lock);
+	}
 }
 
 void kvm_vgic_sync_from_cpu(struct kvm_vcpu *vcpu)
@@ -899,16 +1306,15 @@ void kvm_vgic_sync_from_cpu(struct kvm_vcpu *vcpu)
 		return;
 
 	__kvm_vgic_sync_from_cpu(vcpu);
+	vgic_notify_acked_irqs(vcpu);
 }
 
 int kvm_vgic_vcpu_pending_irq(struct kvm_vcpu *vcpu)
 {
-	struct vgic_dist *dist = &vcpu->kvm->arch.vgic;
-
 	if (!irqchip_in_kernel(vcpu->kvm))
 		return 0;
 
-	return test_bit(vcpu->vcpu_id, &dist->irq_pending_on_cpu);
+	return test_bit(VGIC_CPU_PENDING, &vcpu->arch.vgic_cpu.flags);
 }
 
 static void vgic_kick_vcpus(struct kvm *kvm)
@@ -917,25 +1323,37 @@ static void vgic_kick_vcpus(struct kvm *kvm)
 	int c;
 
 	/*
-	 * We've injected an interrupt, time to find out who deserves
-	 * a good kick...
+	 * We've injected an interrupt, time to kick the vcpus which got
+	 * something new to deal with...
 	 */
 	kvm_for_each_vcpu(c, vcpu, kvm) {
-		if (kvm_vgic_vcpu_pending_irq(vcpu))
+		if (test_and_clear_bit(VGIC_CPU_KICK, &vcpu->arch.vgic_cpu.flags) &&
+		    kvm_vgic_vcpu_pending_irq(vcpu))
 			kvm_vcpu_kick(vcpu);
 	}
 }
 
-static bool vgic_update_irq_state(struct kvm *kvm, int cpuid,
-				  unsigned int irq_num, bool level)
+/*
+ * Update the line state of an interrupt. Return the id of the vcpu the
+ * interrupt has been made pending on, or -1 if nothing new is pending.
+ */
+static int vgic_update_irq_state(struct kvm *kvm, int cpuid,
+				 unsigned int irq_num, bool level)
 {
 	struct vgic_dist *dist = &kvm->arch.vgic;
 	struct kvm_vcpu *vcpu;
+	spinlock_t *lock;
 	int is_edge, is_level, state;
 	int enabled;
-	bool ret = true;
+	int ret = -1;
 
-	spin_lock(&dist->lock);
+	/*
+	 * SGIs and PPIs are banked: injecting one only involves the vcpu
+	 * it is injected on, whose lock is enough.
+	 */
+	vcpu = kvm_get_vcpu(kvm, cpuid);
+	lock = (irq_num < 32) ? &vcpu->arch.vgic_cpu.lock : &dist->lock;
+	spin_lock(lock);
 
 	is_edge = vgic_irq_is_edge(dist, irq_num);
 	is_level = !is_edge;
@@ -946,19 +1364,15 @@ static bool vgic_update_irq_state(struct kvm *kvm, int cpuid,
 	 * - level triggered and we change level
 	 * - edge triggered and we have a rising edge
 	 */
-	if ((is_level && !(state ^ level)) || (is_edge && (state || !level))) {
-		ret = false;
+	if ((is_level && !(state ^ level)) || (is_edge && (state || !level)))
 		goto out;
-	}
 
 	vgic_bitmap_set_irq_val(&dist->irq_state, cpuid, irq_num, level);
 
 	enabled = vgic_bitmap_get_irq_val(&dist->irq_enabled, cpuid, irq_num);
 
-	if (!enabled) {
-		ret = false;
+	if (!enabled)
 		goto out;
-	}
 
 	if (is_level && vgic_bitmap_get_irq_val(&dist->irq_active,
 						cpuid, irq_num)) {
@@ -966,24 +1380,28 @@ static bool vgic_update_irq_state(struct kvm *kvm, int cpuid,
 		 * Level interrupt in progress, will be picked up
 		 * when EOId.
 		 */
-		ret = false;
 		goto out;
 	}
 
-	if (irq_num >= 32)
+	if (irq_num >= 32) {
 		cpuid = dist->irq_spi_cpu[irq_num - 32];
+		vcpu = kvm_get_vcpu(kvm, cpuid);
+	}
 
 	kvm_debug("Inject IRQ%d level %d CPU%d\n", irq_num, level, cpuid);
 
-	vcpu = kvm_get_vcpu(kvm, cpuid);
-
 	if (level) {
+		if (irq_num >= 32)
+			spin_lock(&vcpu->arch.vgic_cpu.lock);
 		kvm_vgic_vcpu_set_pending_irq(vcpu, irq_num);
-		set_bit(cpuid, &dist->irq_pending_on_cpu);
+		vgic_cpu_set_pending(vcpu, false);
+		if (irq_num >= 32)
+			spin_unlock(&vcpu->arch.vgic_cpu.lock);
+		ret = cpuid;
 	}
 
 out:
-	spin_unlock(&dist->lock);
+	spin_unlock(lock);
 
 	return ret;
 }
@@ -991,12 +1409,61 @@ out:
 int kvm_vgic_inject_irq(struct kvm *kvm, int cpuid, unsigned int irq_num,
 			bool level)
 {
-	if (vgic_update_irq_state(kvm, cpuid, irq_num, level))
-		vgic_kick_vcpus(kvm);
+	int vcpu_id;
+
+	vcpu_id = vgic_update_irq_state(kvm, cpuid, irq_num, level);
+	if (vcpu_id >= 0)
+		kvm_vcpu_kick(kvm_get_vcpu(kvm, vcpu_id));
 
 	return 0;
 }
 
+/*
+ * irqfd support: the gsi of an irqfd is the SPI number minus 32, and the
+ * irq source is ignored, as the distributor only tracks a single level
+ * per interrupt.
+ */
+int kvm_set_irq(struct kvm *kvm, int irq_source_id, u32 irq, int level)
+{
+	unsigned int irq_num = irq + 32;
+
+	trace_kvm_set_irq(irq, level, irq_source_id);
+
+	if (!irqchip_in_kernel(kvm) || irq_num >= VGIC_NR_IRQS)
+		return -EINVAL;
+
+	return kvm_vgic_inject_irq(kvm, 0, irq_num, level);
+}
+
+void kvm_notify_acked_irq(struct kvm *kvm, unsigned irqchip, unsigned pin)
+{
+	struct kvm_irq_ack_notifier *kian;
+	struct hlist_node *n;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(kian, n, &kvm->irq_ack_notifier_list, link)
+		if (kian->gsi == pin)
+			kian->irq_acked(kian);
+	rcu_read_unlock();
+}
+
+void kvm_register_irq_ack_notifier(struct kvm *kvm,
+				   struct kvm_irq_ack_notifier *kian)
+{
+	mutex_lock(&kvm->irq_lock);
+	hlist_add_head_rcu(&kian->link, &kvm->irq_ack_notifier_list);
+	mutex_unlock(&kvm->irq_lock);
+}
+
+void kvm_unregister_irq_ack_notifier(struct kvm *kvm,
+				     struct kvm_irq_ack_notifier *kian)
+{
+	mutex_lock(&kvm->irq_lock);
+	hlist_del_init_rcu(&kian->link);
+	mutex_unlock(&kvm->irq_lock);
+	synchronize_rcu();
+}
+
 static irqreturn_t vgic_maintenance_handler(int irq, void *data)
 {
 	struct kvm_vcpu *vcpu = *(struct kvm_vcpu **)data;
@@ -1010,13 +1477,15 @@ static irqreturn_t vgic_maintenance_handler(int irq, void *data)
 	vgic_cpu = &vcpu->arch.vgic_cpu;
 	dist = &vcpu->kvm->arch.vgic;
 	kvm_debug("MISR = %08x\n", vgic_cpu->vgic_misr);
+	++vcpu->stat.vgic_maint_irq;
 
 	/*
-	 * We do not need to take the distributor lock here, since the only
-	 * action we perform is clearing the irq_active_bit for an EOIed
-	 * level interrupt.  There is a potential race with
-	 * the queuing of an interrupt in __kvm_sync_to_cpu(), where we check
-	 * if the interrupt is already active. Two possibilities:
+	 * We do not need to take the distributor lock (nor the vcpu lock,
+	 * which isn't IRQ safe) here, since the only action we perform is
+	 * clearing the irq_active_bit for an EOIed level interrupt. There
+	 * is a potential race with the queuing of an interrupt in
+	 * __kvm_sync_to_cpu(), where we check if the interrupt is already
+	 * active. Two possibilities:
 	 *
 	 * - The queuing is occuring on the same vcpu: cannot happen, as we're
 	 *   already in the context of this vcpu, and executing the handler
@@ -1038,6 +1507,8 @@ static irqreturn_t vgic_maintenance_handler(int irq, void *data)
 			vgic_bitmap_set_irq_val(&dist->irq_active,
 						vcpu->vcpu_id, irq, 0);
 			atomic_dec(&vgic_cpu->irq_active_count);
+			if (irq >= 32)
+				set_bit(irq - 32, vgic_cpu->eoied_shared);
 			smp_mb();
 			vgic_cpu->vgic_lr[lr] &= ~VGIC_LR_EOI;
 			writel_relaxed(vgic_cpu->vgic_lr[lr],
@@ -1047,8 +1518,7 @@ static irqreturn_t vgic_maintenance_handler(int irq, void *data)
 			if (vgic_bitmap_get_irq_val(&dist->irq_state,
 						    vcpu->vcpu_id, irq)) {
 				kvm_vgic_vcpu_set_pending_irq(vcpu, irq);
-				set_bit(vcpu->vcpu_id,
-					&dist->irq_pending_on_cpu);
+				set_bit(VGIC_CPU_PENDING, &vgic_cpu->flags);
 			} else {
 				kvm_vgic_vcpu_clear_pending_irq(vcpu, irq);
 			}
@@ -1070,6 +1540,8 @@ int kvm_vgic_vcpu_init(struct kvm_vcpu *vcpu)
 	u32 reg;
 	int i;
 
+	spin_lock_init(&vgic_cpu->lock);
+
 	if (!irqchip_in_kernel(vcpu->kvm))
 		return 0;
 
@@ -1102,6 +1574,15 @@ int kvm_vgic_vcpu_init(struct kvm_vcpu *vcpu)
 static void vgic_init_maintenance_interrupt(void *info)
 {
 	unsigned int *irqp = info;
+	int lr, nr_lr;
+
+	/*
+	 * The world switch only restores the LRs a vcpu uses, and relies
+	 * on the others being empty. Start from a clean state.
+	 */
+	nr_lr = (readl_relaxed(vgic_vctrl_base + GICH_VTR) & 0x1f) + 1;
+	for (lr = 0; lr < nr_lr; lr++)
+		writel_relaxed(0, vgic_vctrl_base + GICH_LR0 + (lr << 2));
 
 	enable_percpu_irq(*irqp, 0);
 }
@@ -1192,8 +1673,12 @@ int kvm_vgic_init(struct kvm *kvm)
 		goto out;
 	}
 
-	for (i = 32; i < VGIC_NR_IRQS; i += 4)
-		vgic_set_target_reg(kvm, 0, i);
+	/*
+	 * Not vgic_set_target_reg(), which skips the interrupts that
+	 * already target CPU0 - that is all of them at this point.
+	 */
+	for (i = 0; i < VGIC_NR_SHARED_IRQS; i++)
+		vgic_set_spi_target(kvm, i, 0);
 
 	kvm_timer_init(kvm);
 	kvm->arch.vgic.ready = true;
@@ -1277,3 +1762,352 @@ int kvm_vgic_set_addr(struct kvm *kvm, unsigned long type, u64 addr)
 	mutex_unlock(&kvm->lock);
 	return r;
 }
+
+/*
+ * The list registers and CPU interface state of a vcpu are only stable
+ * while it is out of KVM_RUN. Fail rather than wait for a vcpu that is
+ * running (or blocked in WFI), userspace is expected to stop them all.
+ */
+static int vgic_lock_all_vcpus(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu;
+	int c, i;
+
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		if (!mutex_trylock(&vcpu->mutex))
+			goto out_unlock;
+	}
+
+	return 0;
+
+out_unlock:
+	for (i = 0; i < c; i++)
+		mutex_unlock(&kvm_get_vcpu(kvm, i)->mutex);
+	return -EBUSY;
+}
+
+static void vgic_unlock_all_vcpus(struct kvm *kvm)
+{
+	struct kvm_vcpu *vcpu;
+	int c;
+
+	kvm_for_each_vcpu(c, vcpu, kvm)
+		mutex_unlock(&vcpu->mutex);
+}
+
+static size_t vgic_state_size(int nr_cpus)
+{
+	return sizeof(struct kvm_arm_vgic_state) +
+	       nr_cpus * sizeof(struct kvm_arm_vgic_cpu_state);
+}
+
+/* Must be called with distributor lock held and all vcpus stopped */
+static void vgic_save_state(struct kvm *kvm, struct kvm_arm_vgic_state *state)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_arm_vgic_dist_state *ds = &state->dist;
+	struct kvm_vcpu *vcpu;
+	int c, i, lr;
+
+	BUILD_BUG_ON(VGIC_NR_IRQS != KVM_ARM_VGIC_NR_IRQS);
+
+	ds->enabled = dist->enabled;
+	ds->nr_irqs = VGIC_NR_IRQS;
+	memcpy(ds->irq_enabled, dist->irq_enabled.shared.reg,
+	       sizeof(ds->irq_enabled));
+	memcpy(ds->irq_state, dist->irq_state.shared.reg,
+	       sizeof(ds->irq_state));
+	memcpy(ds->irq_active, dist->irq_active.shared.reg,
+	       sizeof(ds->irq_active));
+	memcpy(ds->irq_cfg, dist->irq_cfg.shared.reg, sizeof(ds->irq_cfg));
+	memcpy(ds->irq_target, dist->irq_spi_cpu, sizeof(ds->irq_target));
+	for (i = 0; i < VGIC_NR_SHARED_IRQS; i++)
+		ds->irq_priority[i] = vgic_bytemap_get_irq_val(&dist->irq_priority,
+							       0, i + 32);
+
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		struct kvm_arm_vgic_cpu_state *cs = &state->cpu[c];
+		struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+
+		/* Stopped vcpus can still get a PPI from their timer */
+		spin_lock(&vgic_cpu->lock);
+		cs->irq_enabled = *vgic_bitmap_get_reg(&dist->irq_enabled, c, 0);
+		cs->irq_state = *vgic_bitmap_get_reg(&dist->irq_state, c, 0);
+		cs->irq_active = *vgic_bitmap_get_reg(&dist->irq_active, c, 0);
+		cs->irq_cfg = *vgic_bitmap_get_reg(&dist->irq_cfg, c, 0);
+		for (i = 0; i < 32; i++)
+			cs->irq_priority[i] =
+				vgic_bytemap_get_irq_val(&dist->irq_priority, c, i);
+		memcpy(cs->sgi_sources, dist->irq_sgi_sources[c],
+		       sizeof(cs->sgi_sources));
+
+		cs->vgic_hcr = vgic_cpu->vgic_hcr;
+		cs->vgic_vmcr = vgic_cpu->vgic_vmcr;
+		cs->vgic_apr = vgic_cpu->vgic_apr;
+		cs->nr_lr = vgic_cpu->nr_lr;
+		for_each_set_bit(lr, vgic_cpu->lr_used, vgic_cpu->nr_lr)
+			cs->vgic_lr[lr] = vgic_cpu->vgic_lr[lr];
+		spin_unlock(&vgic_cpu->lock);
+	}
+}
+
+/*
+ * Check a state blob against the vcpus of this VM before touching
+ * anything, so that a failed restore leaves the VGIC as it was.
+ */
+static int vgic_check_state(struct kvm *kvm, struct kvm_arm_vgic_state *state)
+{
+	struct kvm_vcpu *vcpu;
+	int c, i, lr;
+
+	if (state->flags || state->dist.nr_irqs != VGIC_NR_IRQS)
+		return -EINVAL;
+
+	for (i = 0; i < VGIC_NR_SHARED_IRQS; i++)
+		if (state->dist.irq_target[i] >= state->nr_cpus)
+			return -EINVAL;
+
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		struct kvm_arm_vgic_cpu_state *cs = &state->cpu[c];
+		DECLARE_BITMAP(seen, VGIC_NR_IRQS);
+		u8 sgi_seen[16] = { 0 };
+
+		bitmap_zero(seen, VGIC_NR_IRQS);
+
+		for (lr = 0; lr < KVM_ARM_VGIC_NR_LRS; lr++) {
+			u32 val = cs->vgic_lr[lr];
+			int irq = val & VGIC_LR_VIRTUALID;
+			int src = LR_PHYSID(val);
+
+			if (!(val & VGIC_LR_STATE))
+				continue;
+
+			/* Restoring onto a host with fewer LRs */
+			if (lr >= vcpu->arch.vgic_cpu.nr_lr)
+				return -EINVAL;
+			if (irq >= VGIC_NR_IRQS)
+				return -EINVAL;
+
+			/*
+			 * An interrupt can only sit in one LR, except SGIs
+			 * which get one LR per source CPU. Only SGIs have a
+			 * source, and it must be one of our vcpus.
+			 */
+			if (irq < 16) {
+				if (src >= state->nr_cpus ||
+				    (sgi_seen[irq] & (1 << src)))
+					return -EINVAL;
+				sgi_seen[irq] |= 1 << src;
+			} else {
+				if (src || test_and_set_bit(irq, seen))
+					return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Must be called with distributor lock held and all vcpus stopped */
+static void vgic_restore_state(struct kvm *kvm,
+			       struct kvm_arm_vgic_state *state)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_arm_vgic_dist_state *ds = &state->dist;
+	struct kvm_vcpu *vcpu;
+	u8 cpu_mask = (1 << state->nr_cpus) - 1;
+	int c, i, lr;
+
+	dist->enabled = ds->enabled & 1;
+	memcpy(dist->irq_enabled.shared.reg, ds->irq_enabled,
+	       sizeof(ds->irq_enabled));
+	memcpy(dist->irq_state.shared.reg, ds->irq_state,
+	       sizeof(ds->irq_state));
+	memcpy(dist->irq_active.shared.reg, ds->irq_active,
+	       sizeof(ds->irq_active));
+	memcpy(dist->irq_cfg.shared.reg, ds->irq_cfg, sizeof(ds->irq_cfg));
+	for (i = 0; i < VGIC_NR_SHARED_IRQS; i++) {
+		vgic_bytemap_set_irq_val(&dist->irq_priority, 0, i + 32,
+					 ds->irq_priority[i]);
+		vgic_set_spi_target(kvm, i, ds->irq_target[i]);
+	}
+
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		struct kvm_arm_vgic_cpu_state *cs = &state->cpu[c];
+		struct vgic_cpu *vgic_cpu = &vcpu->arch.vgic_cpu;
+
+		spin_lock(&vgic_cpu->lock);
+		*vgic_bitmap_get_reg(&dist->irq_enabled, c, 0) = cs->irq_enabled;
+		*vgic_bitmap_get_reg(&dist->irq_state, c, 0) = cs->irq_state;
+		*vgic_bitmap_get_reg(&dist->irq_active, c, 0) = cs->irq_active;
+		*vgic_bitmap_get_reg(&dist->irq_cfg, c, 0) = cs->irq_cfg;
+		for (i = 0; i < 32; i++)
+			vgic_bytemap_set_irq_val(&dist->irq_priority, c, i,
+						 cs->irq_priority[i]);
+		for (i = 0; i < 16; i++)
+			dist->irq_sgi_sources[c][i] = cs->sgi_sources[i] & cpu_mask;
+
+		vgic_cpu->vgic_hcr = cs->vgic_hcr;
+		vgic_cpu->vgic_vmcr = cs->vgic_vmcr;
+		vgic_cpu->vgic_apr = cs->vgic_apr;
+
+		/* Rebuild the LR bookkeeping from the LR contents */
+		bitmap_zero(vgic_cpu->lr_used, 64);
+		memset(vgic_cpu->vgic_irq_lr_map, LR_EMPTY,
+		       sizeof(vgic_cpu->vgic_irq_lr_map));
+		atomic_set(&vgic_cpu->irq_active_count, 0);
+		for (lr = 0; lr < vgic_cpu->nr_lr; lr++) {
+			u32 val = cs->vgic_lr[lr];
+
+			vgic_cpu->vgic_lr[lr] = val;
+			if (!(val & VGIC_LR_STATE))
+				continue;
+
+			set_bit(lr, vgic_cpu->lr_used);
+			vgic_cpu->vgic_irq_lr_map[val & VGIC_LR_VIRTUALID] = lr;
+			if (val & VGIC_LR_EOI)
+				atomic_inc(&vgic_cpu->irq_active_count);
+		}
+
+		bitmap_zero(vgic_cpu->pending_percpu, 32);
+		bitmap_zero(vgic_cpu->pending_shared, VGIC_NR_SHARED_IRQS);
+		bitmap_zero(vgic_cpu->eoied_shared, VGIC_NR_SHARED_IRQS);
+		vgic_cpu->flags = 0;
+		spin_unlock(&vgic_cpu->lock);
+	}
+
+	vgic_update_state(kvm);
+
+	/* Queued interrupts must get the vcpu back in, like sync_from_cpu */
+	kvm_for_each_vcpu(c, vcpu, kvm) {
+		if (find_first_bit(vcpu->arch.vgic_cpu.lr_used, 64) < 64)
+			set_bit(VGIC_CPU_PENDING, &vcpu->arch.vgic_cpu.flags);
+
+		/* Nothing is running, the vcpus see the pending flag on entry */
+		clear_bit(VGIC_CPU_KICK, &vcpu->arch.vgic_cpu.flags);
+	}
+}
+
+/**
+ * kvm_vgic_get_state - save the complete VGIC state of a VM
+ * @kvm:	The VM pointer
+ * @ustate:	Userspace buffer, with room for ustate->nr_cpus vcpus
+ *
+ * The distributor and all the CPU interfaces are saved in one go, with
+ * every vcpu stopped. If the buffer is too small, the required number
+ * of vcpus is written back to ustate->nr_cpus and -E2BIG returned.
+ */
+int kvm_vgic_get_state(struct kvm *kvm, struct kvm_arm_vgic_state __user *ustate)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_arm_vgic_state *state;
+	u32 nr_cpus, user_nr_cpus;
+	size_t size;
+	int ret;
+
+	if (!irqchip_in_kernel(kvm))
+		return -ENXIO;
+
+	if (get_user(user_nr_cpus, &ustate->nr_cpus))
+		return -EFAULT;
+
+	mutex_lock(&kvm->lock);
+
+	nr_cpus = atomic_read(&kvm->online_vcpus);
+	ret = -EFAULT;
+	if (put_user(nr_cpus, &ustate->nr_cpus))
+		goto out;
+	ret = -E2BIG;
+	if (user_nr_cpus < nr_cpus)
+		goto out;
+
+	size = vgic_state_size(nr_cpus);
+	ret = -ENOMEM;
+	state = kzalloc(size, GFP_KERNEL);
+	if (!state)
+		goto out;
+
+	ret = vgic_lock_all_vcpus(kvm);
+	if (ret)
+		goto out_free;
+
+	state->nr_cpus = nr_cpus;
+	spin_lock(&dist->lock);
+	vgic_save_state(kvm, state);
+	spin_unlock(&dist->lock);
+
+	vgic_unlock_all_vcpus(kvm);
+
+	if (copy_to_user(ustate, state, size))
+		ret = -EFAULT;
+
+out_free:
+	kfree(state);
+out:
+	mutex_unlock(&kvm->lock);
+	return ret;
+}
+
+/**
+ * kvm_vgic_set_state - restore the complete VGIC state of a VM
+ * @kvm:	The VM pointer
+ * @ustate:	Userspace buffer, as filled by kvm_vgic_get_state()
+ *
+ * The VGIC is initialized first if needed (so that the initial
+ * interrupt routing doesn't later overwrite the restored one), which
+ * requires the distributor and CPU interface addresses to be set.
+ * ustate->nr_cpus must match the number of vcpus of the VM.
+ */
+int kvm_vgic_set_state(struct kvm *kvm, struct kvm_arm_vgic_state __user *ustate)
+{
+	struct vgic_dist *dist = &kvm->arch.vgic;
+	struct kvm_arm_vgic_state *state;
+	u32 nr_cpus;
+	size_t size;
+	int ret;
+
+	if (!irqchip_in_kernel(kvm))
+		return -ENXIO;
+
+	ret = kvm_vgic_init(kvm);
+	if (ret)
+		return ret;
+
+	if (get_user(nr_cpus, &ustate->nr_cpus))
+		return -EFAULT;
+
+	mutex_lock(&kvm->lock);
+
+	ret = -EINVAL;
+	if (nr_cpus != atomic_read(&kvm->online_vcpus))
+		goto out;
+
+	size = vgic_state_size(nr_cpus);
+	state = memdup_user(ustate, size);
+	if (IS_ERR(state)) {
+		ret = PTR_ERR(state);
+		goto out;
+	}
+
+	/* Userspace may have changed it under our feet */
+	state->nr_cpus = nr_cpus;
+	ret = vgic_check_state(kvm, state);
+	if (ret)
+		goto out_free;
+
+	ret = vgic_lock_all_vcpus(kvm);
+	if (ret)
+		goto out_free;
+
+	spin_lock(&dist->lock);
+	vgic_restore_state(kvm, state);
+	spin_unlock(&dist->lock);
+
+	vgic_unlock_all_vcpus(kvm);
+
+out_free:
+	kfree(state);
+out:
+	mutex_unlock(&kvm->lock);
+	return ret;
+}
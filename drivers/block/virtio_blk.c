@@ -22,11 +22,25 @@ static DEFINE_IDA(vd_index_ida);
 
 struct workqueue_struct *virtblk_wq;
 
+#define VQ_NAME_LEN 16
+
+struct virtio_blk_vq {
+	struct virtqueue *vq;
+	/* Serializes access to the vring */
+	spinlock_t lock;
+	/* Bio submitters waiting for room in the vring */
+	wait_queue_head_t queue_wait;
+	/* The vring keeps a pointer to its name */
+	char name[VQ_NAME_LEN];
+} ____cacheline_aligned_in_smp;
+
 struct virtio_blk
 {
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
-	wait_queue_head_t queue_wait;
+
+	/* Request virtqueues, submitting CPUs are spread over them. */
+	unsigned int num_vqs;
+	struct virtio_blk_vq *vqs;
 
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
@@ -60,6 +74,7 @@ struct virtblk_req
 	struct virtio_scsi_inhdr in_hdr;
 	struct work_struct work;
 	struct virtio_blk *vblk;
+	struct list_head list;
 	int flags;
 	u8 status;
 	struct scatterlist sg[];
@@ -100,47 +115,64 @@ static inline struct virtblk_req *virtblk_alloc_req(struct virtio_blk *vblk,
 	return vbr;
 }
 
-static void virtblk_add_buf_wait(struct virtio_blk *vblk,
+/*
+ * CPU i submits to virtqueue i % num_vqs, whose interrupt is steered back
+ * to CPU i (see init_vq), so that completions run where the I/O was issued.
+ */
+static inline struct virtio_blk_vq *virtblk_cpu_to_vq(struct virtio_blk *vblk)
+{
+	return &vblk->vqs[raw_smp_processor_id() % vblk->num_vqs];
+}
+
+static void virtblk_add_buf_wait(struct virtio_blk_vq *bvq,
 				 struct virtblk_req *vbr,
 				 unsigned long out,
 				 unsigned long in)
 {
 	DEFINE_WAIT(wait);
+	bool notify;
 
 	for (;;) {
-		prepare_to_wait_exclusive(&vblk->queue_wait, &wait,
+		prepare_to_wait_exclusive(&bvq->queue_wait, &wait,
 					  TASK_UNINTERRUPTIBLE);
 
-		spin_lock_irq(vblk->disk->queue->queue_lock);
-		if (virtqueue_add_buf(vblk->vq, vbr->sg, out, in, vbr,
+		spin_lock_irq(&bvq->lock);
+		if (virtqueue_add_buf(bvq->vq, vbr->sg, out, in, vbr,
 				      GFP_ATOMIC) < 0) {
-			spin_unlock_irq(vblk->disk->queue->queue_lock);
+			spin_unlock_irq(&bvq->lock);
 			io_schedule();
 		} else {
-			virtqueue_kick(vblk->vq);
-			spin_unlock_irq(vblk->disk->queue->queue_lock);
+			notify = virtqueue_kick_prepare(bvq->vq);
+			spin_unlock_irq(&bvq->lock);
+			if (notify)
+				virtqueue_notify(bvq->vq);
 			break;
 		}
 
 	}
 
-	finish_wait(&vblk->queue_wait, &wait);
+	finish_wait(&bvq->queue_wait, &wait);
 }
 
 static inline void virtblk_add_req(struct virtblk_req *vbr,
 				   unsigned int out, unsigned int in)
 {
-	struct virtio_blk *vblk = vbr->vblk;
+	struct virtio_blk_vq *bvq = virtblk_cpu_to_vq(vbr->vblk);
+	bool notify;
 
-	spin_lock_irq(vblk->disk->queue->queue_lock);
-	if (unlikely(virtqueue_add_buf(vblk->vq, vbr->sg, out, in, vbr,
+	spin_lock_irq(&bvq->lock);
+	if (unlikely(virtqueue_add_buf(bvq->vq, vbr->sg, out, in, vbr,
 					GFP_ATOMIC) < 0)) {
-		spin_unlock_irq(vblk->disk->queue->queue_lock);
-		virtblk_add_buf_wait(vblk, vbr, out, in);
+		spin_unlock_irq(&bvq->lock);
+		virtblk_add_buf_wait(bvq, vbr, out, in);
 		return;
 	}
-	virtqueue_kick(vblk->vq);
-	spin_unlock_irq(vblk->disk->queue->queue_lock);
+	notify = virtqueue_kick_prepare(bvq->vq);
+	spin_unlock_irq(&bvq->lock);
+
+	/* The notification exits to the host: don't hold the lock over it. */
+	if (notify)
+		virtqueue_notify(bvq->vq);
 }
 
 static int virtblk_bio_send_flush(struct virtblk_req *vbr)
@@ -268,35 +300,48 @@ static inline void virtblk_bio_done(struct virtblk_req *vbr)
 static void virtblk_done(struct virtqueue *vq)
 {
 	struct virtio_blk *vblk = vq->vdev->priv;
-	bool bio_done = false, req_done = false;
-	struct virtblk_req *vbr;
+	struct virtio_blk_vq *bvq = &vblk->vqs[virtqueue_get_queue_index(vq)];
+	struct request_queue *q = vblk->disk->queue;
+	struct virtblk_req *vbr, *tmp;
+	LIST_HEAD(bios);
+	LIST_HEAD(reqs);
 	unsigned long flags;
 	unsigned int len;
 
-	spin_lock_irqsave(vblk->disk->queue->queue_lock, flags);
+	spin_lock_irqsave(&bvq->lock, flags);
 	do {
 		virtqueue_disable_cb(vq);
-		while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-			if (vbr->bio) {
-				virtblk_bio_done(vbr);
-				bio_done = true;
-			} else {
-				virtblk_request_done(vbr);
-				req_done = true;
-			}
+		while ((vbr = virtqueue_get_buf(vq, &len)) != NULL) {
+			if (vbr->bio)
+				list_add_tail(&vbr->list, &bios);
+			else
+				list_add_tail(&vbr->list, &reqs);
 		}
 	} while (!virtqueue_enable_cb(vq));
-	/* In case queue is stopped waiting for more buffers. */
-	if (req_done)
-		blk_start_queue(vblk->disk->queue);
-	spin_unlock_irqrestore(vblk->disk->queue->queue_lock, flags);
+	spin_unlock_irqrestore(&bvq->lock, flags);
 
-	if (bio_done)
-		wake_up(&vblk->queue_wait);
+	/*
+	 * Complete outside the vq lock: virtblk_request() takes it with the
+	 * queue lock held, so requests can only be ended after dropping it.
+	 */
+	if (!list_empty(&reqs)) {
+		spin_lock_irqsave(q->queue_lock, flags);
+		list_for_each_entry_safe(vbr, tmp, &reqs, list)
+			virtblk_request_done(vbr);
+		/* In case queue is stopped waiting for more buffers. */
+		blk_start_queue(q);
+		spin_unlock_irqrestore(q->queue_lock, flags);
+	}
+
+	if (!list_empty(&bios)) {
+		list_for_each_entry_safe(vbr, tmp, &bios, list)
+			virtblk_bio_done(vbr);
+		wake_up(&bvq->queue_wait);
+	}
 }
 
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
-		   struct request *req)
+		   struct virtio_blk_vq *bvq, struct request *req)
 {
 	unsigned long num, out = 0, in = 0;
 	struct virtblk_req *vbr;
@@ -367,7 +412,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr,
+	if (virtqueue_add_buf(bvq->vq, vblk->sg, out, in, vbr,
 			      GFP_ATOMIC) < 0) {
 		mempool_free(vbr, vblk->pool);
 		return false;
@@ -379,15 +424,19 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 static void virtblk_request(struct request_queue *q)
 {
 	struct virtio_blk *vblk = q->queuedata;
+	struct virtio_blk_vq *bvq = virtblk_cpu_to_vq(vblk);
 	struct request *req;
 	unsigned int issued = 0;
+	bool notify = false;
 
+	/* The queue lock is held with interrupts disabled. */
+	spin_lock(&bvq->lock);
 	while ((req = blk_peek_request(q)) != NULL) {
 		BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
 
 		/* If this request fails, stop queue and wait for something to
 		   finish to restart it. */
-		if (!do_req(q, vblk, req)) {
+		if (!do_req(q, vblk, bvq, req)) {
 			blk_stop_queue(q);
 			break;
 		}
@@ -396,7 +445,11 @@ static void virtblk_request(struct request_queue *q)
 	}
 
 	if (issued)
-		virtqueue_kick(vblk->vq);
+		notify = virtqueue_kick_prepare(bvq->vq);
+	spin_unlock(&bvq->lock);
+
+	if (notify)
+		virtqueue_notify(bvq->vq);
 }
 
 static void virtblk_make_request(struct request_queue *q, struct bio *bio)
@@ -581,13 +634,72 @@ static void virtblk_config_changed(struct virtio_device *vdev)
 
 static int init_vq(struct virtio_blk *vblk)
 {
-	int err = 0;
+	struct virtio_device *vdev = vblk->vdev;
+	struct virtio_blk_vq *bvq;
+	vq_callback_t **callbacks;
+	struct virtqueue **vqs;
+	const char **names;
+	unsigned int i;
+	u16 num_vqs;
+	int err;
+
+	/* Without VIRTIO_BLK_F_MQ there is one virtqueue, for output. */
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_MQ,
+				offsetof(struct virtio_blk_config, num_queues),
+				&num_vqs);
+	if (err || !num_vqs)
+		num_vqs = 1;
+
+	/* Queues beyond one per CPU would never be submitted to. */
+	num_vqs = min_t(unsigned int, num_vqs, nr_cpu_ids);
+
+	vblk->vqs = kcalloc(num_vqs, sizeof(*vblk->vqs), GFP_KERNEL);
+	callbacks = kmalloc(num_vqs * sizeof(*callbacks), GFP_KERNEL);
+	names = kmalloc(num_vqs * sizeof(*names), GFP_KERNEL);
+	vqs = kmalloc(num_vqs * sizeof(*vqs), GFP_KERNEL);
+	if (!vblk->vqs || !callbacks || !names || !vqs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_vqs; i++) {
+		bvq = &vblk->vqs[i];
+		if (num_vqs == 1)
+			strlcpy(bvq->name, "requests", VQ_NAME_LEN);
+		else
+			snprintf(bvq->name, VQ_NAME_LEN, "requests.%u", i);
+		callbacks[i] = virtblk_done;
+		names[i] = bvq->name;
+	}
+
+	err = vdev->config->find_vqs(vdev, num_vqs, vqs, callbacks, names);
+	if (err)
+		goto out;
 
-	/* We expect one virtqueue, for output. */
-	vblk->vq = virtio_find_single_vq(vblk->vdev, virtblk_done, "requests");
-	if (IS_ERR(vblk->vq))
-		err = PTR_ERR(vblk->vq);
+	for (i = 0; i < num_vqs; i++) {
+		bvq = &vblk->vqs[i];
+		bvq->vq = vqs[i];
+		spin_lock_init(&bvq->lock);
+		init_waitqueue_head(&bvq->queue_wait);
+
+		/*
+		 * Steer completions to the CPU submitting on this queue.
+		 * This is only a hint, and transports sharing one interrupt
+		 * between all queues can't honour it.
+		 */
+		if (num_vqs > 1)
+			virtqueue_set_affinity(bvq->vq, i);
+	}
+	vblk->num_vqs = num_vqs;
 
+out:
+	kfree(vqs);
+	kfree(names);
+	kfree(callbacks);
+	if (err) {
+		kfree(vblk->vqs);
+		vblk->vqs = NULL;
+	}
 	return err;
 }
 
@@ -732,7 +844,6 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_free_index;
 	}
 
-	init_waitqueue_head(&vblk->queue_wait);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
 	sg_init_table(vblk->sg, vblk->sg_elems);
@@ -877,6 +988,7 @@ out_mempool:
 	mempool_destroy(vblk->pool);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 out_free_vblk:
 	kfree(vblk);
 out_free_index:
@@ -906,6 +1018,7 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	put_disk(vblk->disk);
 	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 	kfree(vblk);
 	ida_simple_remove(&vd_index_ida, index);
 }
@@ -931,6 +1044,8 @@ static int virtblk_freeze(struct virtio_device *vdev)
 	blk_sync_queue(vblk->disk->queue);
 
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
+	vblk->vqs = NULL;
 	return 0;
 }
 
@@ -958,7 +1073,8 @@ static const struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
-	VIRTIO_BLK_F_WCE, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_CONFIG_WCE
+	VIRTIO_BLK_F_WCE, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_CONFIG_WCE,
+	VIRTIO_BLK_F_MQ
 };
 
 /*
@@ -108,6 +108,24 @@ static void copy_iovec_hdr(const struct iovec *from, struct iovec *to,
 	}
 }
 
+/* Busy polling clock, in (roughly) microseconds. Only consistent on one
+ * CPU, so busy loops run with preemption disabled. */
+static unsigned long busy_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+/* Keep busy polling until timeout, unless something else wants the CPU or
+ * the worker. */
+static bool vhost_can_busy_poll(struct vhost_virtqueue *vq,
+				unsigned long endtime)
+{
+	return likely(!need_resched()) &&
+	       likely(!time_after(busy_clock(), endtime)) &&
+	       likely(!signal_pending(current)) &&
+	       !vhost_vq_has_work(vq);
+}
+
 /* Caller must have TX VQ lock */
 static void tx_poll_stop(struct vhost_net *net)
 {
@@ -126,6 +144,31 @@ static void tx_poll_start(struct vhost_net *net, struct socket *sock)
 	net->tx_poll_state = VHOST_NET_POLL_STARTED;
 }
 
+/* Caller must have TX VQ lock. Guest notifications must be disabled. */
+static int vhost_net_tx_get_vq_desc(struct vhost_net *net,
+				    struct vhost_virtqueue *vq,
+				    unsigned int *out_num, unsigned int *in_num)
+{
+	unsigned long endtime;
+	int r;
+
+	r = vhost_get_vq_desc(&net->dev, vq, vq->iov, ARRAY_SIZE(vq->iov),
+			      out_num, in_num, NULL, NULL);
+	if (r == vq->num && vq->busyloop_timeout) {
+		preempt_disable();
+		endtime = busy_clock() + vq->busyloop_timeout;
+		while (vhost_can_busy_poll(vq, endtime) &&
+		       vhost_vq_avail_empty(&net->dev, vq))
+			cpu_relax();
+		preempt_enable();
+		r = vhost_get_vq_desc(&net->dev, vq, vq->iov,
+				      ARRAY_SIZE(vq->iov), out_num, in_num,
+				      NULL, NULL);
+	}
+
+	return r;
+}
+
 /* Expects to be always run from workqueue - which acts as
  * read-size critical section for our kind of RCU. */
 static void handle_tx(struct vhost_net *net)
@@ -174,10 +217,7 @@ static void handle_tx(struct vhost_net *net)
 		if (zcopy)
 			vhost_zerocopy_signal_used(vq);
 
-		head = vhost_get_vq_desc(&net->dev, vq, vq->iov,
-					 ARRAY_SIZE(vq->iov),
-					 &out, &in,
-					 NULL, NULL);
+		head = vhost_net_tx_get_vq_desc(net, vq, &out, &in);
 		/* On error, stop handling until the next kick. */
 		if (unlikely(head < 0))
 			break;
@@ -297,6 +337,55 @@ static int peek_head_len(struct sock *sk)
 	return len;
 }
 
+/*
+ * Caller must have RX VQ lock. With nothing to receive, busy poll both the
+ * socket and the TX ring: under request/response loads, the next packet
+ * we see is often a request sent by the guest. TX lock nests inside RX.
+ * The TX ring is only polled when it shares our worker: otherwise we would
+ * hold its mutex while its own handler wants to run.
+ */
+static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk)
+{
+	struct vhost_virtqueue *rvq = &net->dev.vqs[VHOST_NET_VQ_RX];
+	struct vhost_virtqueue *tvq = &net->dev.vqs[VHOST_NET_VQ_TX];
+	unsigned long endtime;
+	bool tx_active = false;
+	int len = peek_head_len(sk);
+
+	if (!len && rvq->busyloop_timeout) {
+		if (tvq->worker == rvq->worker) {
+			/* All vq mutexes share a lockdep class */
+			mutex_lock_nested(&tvq->mutex, 1);
+			tx_active = rcu_dereference_protected(tvq->private_data,
+					lockdep_is_held(&tvq->mutex)) != NULL;
+			if (tx_active)
+				vhost_disable_notify(&net->dev, tvq);
+			else
+				mutex_unlock(&tvq->mutex);
+		}
+
+		preempt_disable();
+		endtime = busy_clock() + rvq->busyloop_timeout;
+		while (vhost_can_busy_poll(rvq, endtime) &&
+		       skb_queue_empty(&sk->sk_receive_queue) &&
+		       (!tx_active || vhost_vq_avail_empty(&net->dev, tvq)))
+			cpu_relax();
+		preempt_enable();
+
+		if (tx_active) {
+			/* Let the TX handler pick up anything the guest
+			 * queued. */
+			if (vhost_enable_notify(&net->dev, tvq))
+				vhost_poll_queue(&tvq->poll);
+			mutex_unlock(&tvq->mutex);
+		}
+
+		len = peek_head_len(sk);
+	}
+
+	return len;
+}
+
 /* This is a multi-buffer version of vhost_get_desc, that works if
  *	vq has read descriptors only.
  * @vq		- the relevant virtqueue
@@ -398,7 +487,7 @@ static void handle_rx(struct vhost_net *net)
 		vq->log : NULL;
 	mergeable = vhost_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF);
 
-	while ((sock_len = peek_head_len(sock->sk))) {
+	while ((sock_len = vhost_net_rx_peek_head_len(net, sock->sk))) {
 		sock_len += sock_hlen;
 		vhost_len = sock_len + vhost_hlen;
 		headcount = get_rx_bufs(vq, vq->heads, vhost_len,
@@ -519,8 +608,10 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		return r;
 	}
 
-	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, POLLOUT, dev);
-	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, POLLIN, dev);
+	vhost_poll_init(n->poll + VHOST_NET_VQ_TX, handle_tx_net, POLLOUT, dev,
+			n->vqs + VHOST_NET_VQ_TX);
+	vhost_poll_init(n->poll + VHOST_NET_VQ_RX, handle_rx_net, POLLIN, dev,
+			n->vqs + VHOST_NET_VQ_RX);
 	n->tx_poll_state = VHOST_NET_POLL_DISABLED;
 
 	f->private_data = n;
@@ -306,7 +306,8 @@ static void vhost_scsi_complete_cmd(struct tcm_vhost_cmd *tv_cmd)
 	list_add_tail(&tv_cmd->tvc_completion_list, &vs->vs_completion_list);
 	spin_unlock_bh(&vs->vs_completion_lock);
 
-	vhost_work_queue(&vs->dev, &vs->vs_completion_work);
+	/* Completions update the request queue ring: run them on its worker */
+	vhost_vq_work_queue(&vs->vqs[2], &vs->vs_completion_work);
 }
 
 static int tcm_vhost_queue_data_in(struct se_cmd *se_cmd)
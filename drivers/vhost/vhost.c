@@ -23,6 +23,7 @@
 #include <linux/file.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/kthread.h>
 #include <linux/cgroup.h>
 
@@ -73,14 +74,17 @@ void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn)
 	work->queue_seq = work->done_seq = 0;
 }
 
-/* Init poll structure */
+/* Init poll structure. If vq is set, the work runs on that virtqueue's
+ * worker, otherwise on the device default one. */
 void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
-		     unsigned long mask, struct vhost_dev *dev)
+		     unsigned long mask, struct vhost_dev *dev,
+		     struct vhost_virtqueue *vq)
 {
 	init_waitqueue_func_entry(&poll->wait, vhost_poll_wakeup);
 	init_poll_funcptr(&poll->table, vhost_poll_func);
 	poll->mask = mask;
 	poll->dev = dev;
+	poll->vq = vq;
 
 	vhost_work_init(&poll->work, fn);
 }
@@ -103,30 +107,31 @@ void vhost_poll_stop(struct vhost_poll *poll)
 	remove_wait_queue(poll->wqh, &poll->wait);
 }
 
-static bool vhost_work_seq_done(struct vhost_dev *dev, struct vhost_work *work,
-				unsigned seq)
+static bool vhost_work_seq_done(struct vhost_worker *worker,
+				struct vhost_work *work, unsigned seq)
 {
 	int left;
 
-	spin_lock_irq(&dev->work_lock);
+	spin_lock_irq(&worker->work_lock);
 	left = seq - work->done_seq;
-	spin_unlock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
 	return left <= 0;
 }
 
-static void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
+static void vhost_work_flush(struct vhost_worker *worker,
+			     struct vhost_work *work)
 {
 	unsigned seq;
 	int flushing;
 
-	spin_lock_irq(&dev->work_lock);
+	spin_lock_irq(&worker->work_lock);
 	seq = work->queue_seq;
 	work->flushing++;
-	spin_unlock_irq(&dev->work_lock);
-	wait_event(work->done, vhost_work_seq_done(dev, work, seq));
-	spin_lock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
+	wait_event(work->done, vhost_work_seq_done(worker, work, seq));
+	spin_lock_irq(&worker->work_lock);
 	flushing = --work->flushing;
-	spin_unlock_irq(&dev->work_lock);
+	spin_unlock_irq(&worker->work_lock);
 	BUG_ON(flushing < 0);
 }
 
@@ -134,25 +139,57 @@ static void vhost_work_flush(struct vhost_dev *dev, struct vhost_work *work)
  * locks that are also used by the callback. */
 void vhost_poll_flush(struct vhost_poll *poll)
 {
-	vhost_work_flush(poll->dev, &poll->work);
+	struct vhost_worker *worker;
+
+	/* Virtqueues only change worker while idle, so any pending work is
+	 * on the current one. */
+	if (poll->vq)
+		worker = poll->vq->worker;
+	else
+		worker = poll->dev->workers ? poll->dev->workers[0] : NULL;
+
+	/* Without a worker nothing can have been queued. */
+	if (worker)
+		vhost_work_flush(worker, &poll->work);
 }
 
-void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work)
+static void vhost_worker_queue(struct vhost_worker *worker,
+			       struct vhost_work *work)
 {
 	unsigned long flags;
 
-	spin_lock_irqsave(&dev->work_lock, flags);
+	spin_lock_irqsave(&worker->work_lock, flags);
 	if (list_empty(&work->node)) {
-		list_add_tail(&work->node, &dev->work_list);
+		list_add_tail(&work->node, &worker->work_list);
 		work->queue_seq++;
-		wake_up_process(dev->worker);
+		wake_up_process(worker->task);
 	}
-	spin_unlock_irqrestore(&dev->work_lock, flags);
+	spin_unlock_irqrestore(&worker->work_lock, flags);
+}
+
+/* Queue device wide work on the default worker. */
+void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work)
+{
+	vhost_worker_queue(dev->workers[0], work);
+}
+
+void vhost_vq_work_queue(struct vhost_virtqueue *vq, struct vhost_work *work)
+{
+	vhost_worker_queue(vq->worker, work);
+}
+
+/* Is work waiting on the virtqueue's worker? Only a hint: no locking. */
+bool vhost_vq_has_work(struct vhost_virtqueue *vq)
+{
+	return !list_empty(&vq->worker->work_list);
 }
 
 void vhost_poll_queue(struct vhost_poll *poll)
 {
-	vhost_work_queue(poll->dev, &poll->work);
+	if (poll->vq)
+		vhost_vq_work_queue(poll->vq, &poll->work);
+	else
+		vhost_work_queue(poll->dev, &poll->work);
 }
 
 static void vhost_vq_reset(struct vhost_dev *dev,
@@ -183,11 +220,14 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->upend_idx = 0;
 	vq->done_idx = 0;
 	vq->ubufs = NULL;
+	vq->worker = NULL;
+	vq->busyloop_timeout = 0;
 }
 
 static int vhost_worker(void *data)
 {
-	struct vhost_dev *dev = data;
+	struct vhost_worker *worker = data;
+	struct vhost_dev *dev = worker->dev;
 	struct vhost_work *work = NULL;
 	unsigned uninitialized_var(seq);
 	mm_segment_t oldfs = get_fs();
@@ -199,7 +239,7 @@ static int vhost_worker(void *data)
 		/* mb paired w/ kthread_stop */
 		set_current_state(TASK_INTERRUPTIBLE);
 
-		spin_lock_irq(&dev->work_lock);
+		spin_lock_irq(&worker->work_lock);
 		if (work) {
 			work->done_seq = seq;
 			if (work->flushing)
@@ -207,18 +247,18 @@ static int vhost_worker(void *data)
 		}
 
 		if (kthread_should_stop()) {
-			spin_unlock_irq(&dev->work_lock);
+			spin_unlock_irq(&worker->work_lock);
 			__set_current_state(TASK_RUNNING);
 			break;
 		}
-		if (!list_empty(&dev->work_list)) {
-			work = list_first_entry(&dev->work_list,
+		if (!list_empty(&worker->work_list)) {
+			work = list_first_entry(&worker->work_list,
 						struct vhost_work, node);
 			list_del_init(&work->node);
 			seq = work->queue_seq;
 		} else
 			work = NULL;
-		spin_unlock_irq(&dev->work_lock);
+		spin_unlock_irq(&worker->work_lock);
 
 		if (work) {
 			__set_current_state(TASK_RUNNING);
@@ -300,11 +340,10 @@ long vhost_dev_init(struct vhost_dev *dev,
 	mutex_init(&dev->mutex);
 	dev->log_ctx = NULL;
 	dev->log_file = NULL;
+	dev->log_map = NULL;
 	dev->memory = NULL;
 	dev->mm = NULL;
-	spin_lock_init(&dev->work_lock);
-	INIT_LIST_HEAD(&dev->work_list);
-	dev->worker = NULL;
+	dev->workers = NULL;
 
 	for (i = 0; i < dev->nvqs; ++i) {
 		dev->vqs[i].log = NULL;
@@ -316,7 +355,8 @@ long vhost_dev_init(struct vhost_dev *dev,
 		vhost_vq_reset(dev, dev->vqs + i);
 		if (dev->vqs[i].handle_kick)
 			vhost_poll_init(&dev->vqs[i].poll,
-					dev->vqs[i].handle_kick, POLLIN, dev);
+					dev->vqs[i].handle_kick, POLLIN, dev,
+					dev->vqs + i);
 	}
 
 	return 0;
@@ -343,22 +383,85 @@ static void vhost_attach_cgroups_work(struct vhost_work *work)
 	s->ret = cgroup_attach_task_all(s->owner, current);
 }
 
-static int vhost_attach_cgroups(struct vhost_dev *dev)
+static int vhost_attach_cgroups(struct vhost_worker *worker)
 {
 	struct vhost_attach_cgroups_struct attach;
 
 	attach.owner = current;
 	vhost_work_init(&attach.work, vhost_attach_cgroups_work);
-	vhost_work_queue(dev, &attach.work);
-	vhost_work_flush(dev, &attach.work);
+	vhost_worker_queue(worker, &attach.work);
+	vhost_work_flush(worker, &attach.work);
 	return attach.ret;
 }
 
+/* Caller should have device mutex and be the owner */
+static struct vhost_worker *vhost_worker_create(struct vhost_dev *dev, int id)
+{
+	struct vhost_worker *worker;
+	struct task_struct *task;
+	int err;
+
+	worker = kmalloc(sizeof *worker, GFP_KERNEL);
+	if (!worker)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_init(&worker->work_lock);
+	INIT_LIST_HEAD(&worker->work_list);
+	worker->dev = dev;
+	worker->id = id;
+
+	if (id)
+		task = kthread_create(vhost_worker, worker, "vhost-%d.%d",
+				      current->pid, id);
+	else
+		task = kthread_create(vhost_worker, worker, "vhost-%d",
+				      current->pid);
+	if (IS_ERR(task)) {
+		err = PTR_ERR(task);
+		goto err_task;
+	}
+
+	worker->task = task;
+	wake_up_process(task);	/* avoid contributing to loadavg */
+
+	err = vhost_attach_cgroups(worker);
+	if (err)
+		goto err_cgroup;
+
+	return worker;
+err_cgroup:
+	kthread_stop(task);
+err_task:
+	kfree(worker);
+	return ERR_PTR(err);
+}
+
+static void vhost_worker_destroy(struct vhost_worker *worker)
+{
+	WARN_ON(!list_empty(&worker->work_list));
+	kthread_stop(worker->task);
+	kfree(worker);
+}
+
+static void vhost_dev_free_workers(struct vhost_dev *dev)
+{
+	int i;
+
+	if (!dev->workers)
+		return;
+
+	for (i = 0; i < dev->nvqs; ++i)
+		if (dev->workers[i])
+			vhost_worker_destroy(dev->workers[i]);
+	kfree(dev->workers);
+	dev->workers = NULL;
+}
+
 /* Caller should have device mutex */
 static long vhost_dev_set_owner(struct vhost_dev *dev)
 {
-	struct task_struct *worker;
-	int err;
+	struct vhost_worker *worker;
+	int i, err;
 
 	/* Is there an owner already? */
 	if (dev->mm) {
@@ -368,28 +471,30 @@ static long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	/* No owner, become one */
 	dev->mm = get_task_mm(current);
-	worker = kthread_create(vhost_worker, dev, "vhost-%d", current->pid);
+	dev->workers = kcalloc(dev->nvqs, sizeof *dev->workers, GFP_KERNEL);
+	if (!dev->workers) {
+		err = -ENOMEM;
+		goto err_worker;
+	}
+
+	worker = vhost_worker_create(dev, 0);
 	if (IS_ERR(worker)) {
 		err = PTR_ERR(worker);
 		goto err_worker;
 	}
-
-	dev->worker = worker;
-	wake_up_process(worker);	/* avoid contributing to loadavg */
-
-	err = vhost_attach_cgroups(dev);
-	if (err)
-		goto err_cgroup;
+	dev->workers[0] = worker;
 
 	err = vhost_dev_alloc_iovecs(dev);
 	if (err)
-		goto err_cgroup;
+		goto err_worker;
+
+	/* All virtqueues start out on the default worker. */
+	for (i = 0; i < dev->nvqs; ++i)
+		dev->vqs[i].worker = worker;
 
 	return 0;
-err_cgroup:
-	kthread_stop(worker);
-	dev->worker = NULL;
 err_worker:
+	vhost_dev_free_workers(dev);
 	if (dev->mm)
 		mmput(dev->mm);
 	dev->mm = NULL;
@@ -438,6 +543,118 @@ int vhost_zerocopy_signal_used(struct vhost_virtqueue *vq)
 	return j;
 }
 
+#define VHOST_LOG_PAGE_BITS (PAGE_SIZE * 8)
+
+/*
+ * Pin the dirty log covering the current memory table, so that log_write()
+ * needn't look each bitmap page up again. Returns NULL if that isn't
+ * possible, or if the owner hasn't acked VHOST_F_LOG_PINNED: writes then
+ * take the slow path.
+ *
+ * The pin is for write, but a fork of the owner still write-protects the
+ * pages and the owner's next write to each one copies it: from then on
+ * bits would be set in pages userspace can't see. Hence the feature bit,
+ * by which the owner promises not to fork or to mark the log
+ * MADV_DONTFORK.
+ */
+static struct vhost_log_map *vhost_log_map_create(struct vhost_dev *d,
+						  void __user *base)
+{
+	unsigned long start = (unsigned long)base;
+	struct vhost_memory *mem;
+	struct vhost_log_map *map;
+	u64 end = 0, nbytes;
+	int i, npages, r;
+
+	if (!vhost_has_feature(d, VHOST_F_LOG_PINNED))
+		return NULL;
+
+	mem = rcu_dereference_protected(d->memory,
+					lockdep_is_held(&d->mutex));
+	for (i = 0; mem && i < mem->nregions; ++i)
+		end = max(end, mem->regions[i].guest_phys_addr +
+			       mem->regions[i].memory_size);
+	if (!end)
+		return NULL;
+
+	nbytes = DIV_ROUND_UP(end, VHOST_PAGE_SIZE * 8);
+	if (nbytes > ULONG_MAX - start || nbytes > INT_MAX - PAGE_SIZE)
+		return NULL;
+	npages = DIV_ROUND_UP(offset_in_page(start) + (unsigned long)nbytes,
+			      PAGE_SIZE);
+
+	map = vzalloc(sizeof *map + npages * sizeof *map->pages);
+	if (!map)
+		return NULL;
+
+	r = get_user_pages_fast(start & PAGE_MASK, npages, 1, map->pages);
+	if (r != npages) {
+		for (i = 0; i < r; ++i)
+			put_page(map->pages[i]);
+		vfree(map);
+		return NULL;
+	}
+
+	map->base = base;
+	map->npages = npages;
+	map->nbits = nbytes * 8;
+	return map;
+}
+
+static void vhost_log_map_free(struct vhost_log_map *map)
+{
+	int i;
+
+	if (!map)
+		return;
+
+	for (i = 0; i < map->npages; ++i) {
+		set_page_dirty_lock(map->pages[i]);
+		put_page(map->pages[i]);
+	}
+	vfree(map);
+}
+
+/* Set nr bits from start, a word at a time. Userspace harvests the log
+ * concurrently, so each update must be atomic. */
+static void vhost_log_set_bits(unsigned long *log, unsigned long start,
+			       unsigned long nr)
+{
+	unsigned long *p, mask, old, n;
+
+	while (nr) {
+		p = log + BIT_WORD(start);
+		n = min(nr, BITS_PER_LONG - start % BITS_PER_LONG);
+		mask = (n == BITS_PER_LONG ? ~0UL : BIT_MASK(n) - 1) <<
+		       (start % BITS_PER_LONG);
+		do {
+			old = ACCESS_ONCE(*p);
+			if ((old & mask) == mask)
+				break;
+		} while (cmpxchg(p, old, old | mask) != old);
+		start += n;
+		nr -= n;
+	}
+}
+
+/* Log nr pages from first through the pinned map. */
+static void vhost_log_map_write(struct vhost_log_map *map, u64 first, u64 nr)
+{
+	u64 bit = offset_in_page((unsigned long)map->base) * 8 + first;
+	unsigned long start, n;
+	void *base;
+
+	while (nr) {
+		start = bit % VHOST_LOG_PAGE_BITS;
+		n = min_t(u64, nr, VHOST_LOG_PAGE_BITS - start);
+		base = kmap_atomic(map->pages[bit / VHOST_LOG_PAGE_BITS]);
+		vhost_log_set_bits(base, start, n);
+		kunmap_atomic(base);
+		bit += n;
+		nr -= n;
+	}
+}
+
 /* Caller should have device mutex if and only if locked is set */
 void vhost_dev_cleanup(struct vhost_dev *dev, bool locked)
 {
@@ -479,11 +696,10 @@ void vhost_dev_cleanup(struct vhost_dev *dev, bool locked)
 					locked ==
 						lockdep_is_held(&dev->mutex)));
 	RCU_INIT_POINTER(dev->memory, NULL);
-	WARN_ON(!list_empty(&dev->work_list));
-	if (dev->worker) {
-		kthread_stop(dev->worker);
-		dev->worker = NULL;
-	}
+	vhost_dev_free_workers(dev);
+	/* Workers are gone: nothing can log anymore. */
+	vhost_log_map_free(rcu_dereference_protected(dev->log_map, 1));
+	RCU_INIT_POINTER(dev->log_map, NULL);
 	if (dev->mm)
 		mmput(dev->mm);
 	dev->mm = NULL;
@@ -634,6 +850,33 @@ static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 	return 0;
 }
 
+/* Caller should have vq mutex and device mutex */
+static long vhost_vq_set_worker(struct vhost_virtqueue *vq, u32 id)
+{
+	struct vhost_dev *d = vq->dev;
+	struct vhost_worker *worker;
+
+	if (id >= d->nvqs)
+		return -EINVAL;
+
+	/* Without backend nor kick eventfd no work can be queued for the
+	 * virtqueue, and anything queued before has been flushed when they
+	 * were removed: it is safe to move. */
+	if (vq->private_data || vq->kick)
+		return -EBUSY;
+
+	worker = d->workers[id];
+	if (!worker) {
+		worker = vhost_worker_create(d, id);
+		if (IS_ERR(worker))
+			return PTR_ERR(worker);
+		d->workers[id] = worker;
+	}
+
+	vq->worker = worker;
+	return 0;
+}
+
 static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 {
 	struct file *eventfp, *filep = NULL;
@@ -700,6 +943,32 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 		if (copy_to_user(argp, &s, sizeof s))
 			r = -EFAULT;
 		break;
+	case VHOST_SET_VRING_WORKER:
+		if (copy_from_user(&s, argp, sizeof s)) {
+			r = -EFAULT;
+			break;
+		}
+		r = vhost_vq_set_worker(vq, s.num);
+		break;
+	case VHOST_GET_VRING_WORKER:
+		s.index = idx;
+		s.num = vq->worker->id;
+		if (copy_to_user(argp, &s, sizeof s))
+			r = -EFAULT;
+		break;
+	case VHOST_SET_VRING_BUSYLOOP_TIMEOUT:
+		if (copy_from_user(&s, argp, sizeof s)) {
+			r = -EFAULT;
+			break;
+		}
+		vq->busyloop_timeout = s.num;
+		break;
+	case VHOST_GET_VRING_BUSYLOOP_TIMEOUT:
+		s.index = idx;
+		s.num = vq->busyloop_timeout;
+		if (copy_to_user(argp, &s, sizeof s))
+			r = -EFAULT;
+		break;
 	case VHOST_SET_VRING_ADDR:
 		if (copy_from_user(&a, argp, sizeof a)) {
 			r = -EFAULT;
@@ -834,6 +1103,7 @@ long vhost_dev_ioctl(struct vhost_dev *d, unsigned int ioctl, unsigned long arg)
 	void __user *argp = (void __user *)arg;
 	struct file *eventfp, *filep = NULL;
 	struct eventfd_ctx *ctx = NULL;
+	struct vhost_log_map *map;
 	u64 p;
 	long r;
 	int i, fd;
@@ -862,6 +1132,10 @@ long vhost_dev_ioctl(struct vhost_dev *d, unsigned int ioctl, unsigned long arg)
 			r = -EFAULT;
 			break;
 		}
+		map = rcu_dereference_protected(d->log_map,
+						lockdep_is_held(&d->mutex));
+		rcu_assign_pointer(d->log_map, vhost_log_map_create(d,
+					(void __user *)(unsigned long)p));
 		for (i = 0; i < d->nvqs; ++i) {
 			struct vhost_virtqueue *vq;
 			void __user *base = (void __user *)(unsigned long)p;
@@ -874,6 +1148,10 @@ long vhost_dev_ioctl(struct vhost_dev *d, unsigned int ioctl, unsigned long arg)
 				vq->log_base = base;
 			mutex_unlock(&vq->mutex);
 		}
+		if (map) {
+			synchronize_rcu();
+			vhost_log_map_free(map);
+		}
 		break;
 	case VHOST_SET_LOG_FD:
 		r = get_user(fd, (int __user *)argp);
@@ -950,17 +1228,37 @@ static int set_bit_to_user(int nr, void __user *addr)
 	return 0;
 }
 
-static int log_write(void __user *log_base,
+static int log_write(struct vhost_virtqueue *vq,
 		     u64 write_address, u64 write_length)
 {
 	u64 write_page = write_address / VHOST_PAGE_SIZE;
+	struct vhost_log_map *map;
+	u64 nr;
 	int r;
 
 	if (!write_length)
 		return 0;
 	write_length += write_address % VHOST_PAGE_SIZE;
+
+	/* Not every caller holds the vq mutex (tcm_vhost completions don't),
+	 * so the pinned map is only used within an RCU read section. It may
+	 * also be for a log base not yet seen by this vq, or left over from
+	 * before the owner dropped VHOST_F_LOG_PINNED. */
+	nr = DIV_ROUND_UP(write_length, VHOST_PAGE_SIZE);
+	rcu_read_lock();
+	map = rcu_dereference(vq->dev->log_map);
+	if (likely(map && map->base == vq->log_base &&
+		   vhost_has_feature(vq->dev, VHOST_F_LOG_PINNED) &&
+		   write_page < map->nbits &&
+		   nr <= map->nbits - write_page)) {
+		vhost_log_map_write(map, write_page, nr);
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
 	for (;;) {
-		u64 base = (u64)(unsigned long)log_base;
+		u64 base = (u64)(unsigned long)vq->log_base;
 		u64 log = base + write_page / 8;
 		int bit = write_page % 8;
 		if ((u64)(unsigned long)log != log)
@@ -985,7 +1283,7 @@ int vhost_log_write(struct vhost_virtqueue *vq, struct vhost_log *log,
 	smp_wmb();
 	for (i = 0; i < log_num; ++i) {
 		u64 l = min(log[i].len, len);
-		r = log_write(vq->log_base, log[i].addr, l);
+		r = log_write(vq, log[i].addr, l);
 		if (r < 0)
 			return r;
 		len -= l;
@@ -1010,7 +1308,7 @@ static int vhost_update_used_flags(struct vhost_virtqueue *vq)
 		smp_wmb();
 		/* Log used flag write. */
 		used = &vq->used->flags;
-		log_write(vq->log_base, vq->log_addr +
+		log_write(vq, vq->log_addr +
 			  (used - (void __user *)vq->used),
 			  sizeof vq->used->flags);
 		if (vq->log_ctx)
@@ -1029,7 +1327,7 @@ static int vhost_update_avail_event(struct vhost_virtqueue *vq, u16 avail_event)
 		smp_wmb();
 		/* Log avail event write */
 		used = vhost_avail_event(vq);
-		log_write(vq->log_base, vq->log_addr +
+		log_write(vq, vq->log_addr +
 			  (used - (void __user *)vq->used),
 			  sizeof *vhost_avail_event(vq));
 		if (vq->log_ctx)
@@ -1360,12 +1658,12 @@ int vhost_add_used(struct vhost_virtqueue *vq, unsigned int head, int len)
 		/* Make sure data is seen before log. */
 		smp_wmb();
 		/* Log used ring entry write. */
-		log_write(vq->log_base,
+		log_write(vq,
 			  vq->log_addr +
 			   ((void __user *)used - (void __user *)vq->used),
 			  sizeof *used);
 		/* Log used index update. */
-		log_write(vq->log_base,
+		log_write(vq,
 			  vq->log_addr + offsetof(struct vring_used, idx),
 			  sizeof vq->used->idx);
 		if (vq->log_ctx)
@@ -1399,7 +1697,7 @@ static int __vhost_add_used_n(struct vhost_virtqueue *vq,
 		/* Make sure data is seen before log. */
 		smp_wmb();
 		/* Log used ring entry write. */
-		log_write(vq->log_base,
+		log_write(vq,
 			  vq->log_addr +
 			   ((void __user *)used - (void __user *)vq->used),
 			  count * sizeof *used);
@@ -1441,7 +1739,7 @@ int vhost_add_used_n(struct vhost_virtqueue *vq, struct vring_used_elem *heads,
 	}
 	if (unlikely(vq->log_used)) {
 		/* Log used index update. */
-		log_write(vq->log_base,
+		log_write(vq,
 			  vq->log_addr + offsetof(struct vring_used, idx),
 			  sizeof vq->used->idx);
 		if (vq->log_ctx)
@@ -1549,6 +1847,20 @@ bool vhost_enable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 	return avail_idx != vq->avail_idx;
 }
 
+/* Has the guest added nothing to the avail ring since we last looked?
+ * Doesn't touch notification state, for polling with notifications off. */
+bool vhost_vq_avail_empty(struct vhost_dev *dev, struct vhost_virtqueue *vq)
+{
+	u16 avail_idx;
+	int r;
+
+	r = __get_user(avail_idx, &vq->avail->idx);
+	if (r)
+		return false;
+
+	return avail_idx == vq->avail_idx;
+}
+
 /* We don't need to be notified again. */
 void vhost_disable_notify(struct vhost_dev *dev, struct vhost_virtqueue *vq)
 {
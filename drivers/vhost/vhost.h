@@ -19,10 +19,20 @@
 #define VHOST_DMA_CLEAR_LEN	0
 
 struct vhost_device;
+struct vhost_virtqueue;
 
 struct vhost_work;
 typedef void (*vhost_work_fn_t)(struct vhost_work *work);
 
+/* A kthread running the work queued by the virtqueues bound to it. */
+struct vhost_worker {
+	spinlock_t		  work_lock;
+	struct list_head	  work_list;
+	struct task_struct	 *task;
+	struct vhost_dev	 *dev;
+	int			  id;
+};
+
 struct vhost_work {
 	struct list_head	  node;
 	vhost_work_fn_t		  fn;
@@ -41,13 +51,17 @@ struct vhost_poll {
 	struct vhost_work	  work;
 	unsigned long		  mask;
 	struct vhost_dev	 *dev;
+	/* Queue the work on this virtqueue's worker, if set. */
+	struct vhost_virtqueue	 *vq;
 };
 
 void vhost_work_init(struct vhost_work *work, vhost_work_fn_t fn);
 void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work);
+void vhost_vq_work_queue(struct vhost_virtqueue *vq, struct vhost_work *work);
 
 void vhost_poll_init(struct vhost_poll *poll, vhost_work_fn_t fn,
-		     unsigned long mask, struct vhost_dev *dev);
+		     unsigned long mask, struct vhost_dev *dev,
+		     struct vhost_virtqueue *vq);
 void vhost_poll_start(struct vhost_poll *poll, struct file *file);
 void vhost_poll_stop(struct vhost_poll *poll);
 void vhost_poll_flush(struct vhost_poll *poll);
@@ -58,8 +72,6 @@ struct vhost_log {
 	u64 len;
 };
 
-struct vhost_virtqueue;
-
 struct vhost_ubuf_ref {
 	struct kref kref;
 	wait_queue_head_t wait;
@@ -89,6 +101,10 @@ struct vhost_virtqueue {
 
 	struct vhost_poll poll;
 
+	/* Worker running this virtqueue's work. Can only change while the
+	 * virtqueue has neither backend nor kick eventfd. */
+	struct vhost_worker *worker;
+
 	/* The routine to call when the Guest pings us, or timeout. */
 	vhost_work_fn_t handle_kick;
 
@@ -110,6 +126,9 @@ struct vhost_virtqueue {
 	/* Last used index value we have signalled on */
 	bool signalled_used_valid;
 
+	/* Time to busy poll for more work before sleeping, in us. */
+	u32 busyloop_timeout;
+
 	/* Log writes to used structure. */
 	bool log_used;
 	u64 log_addr;
@@ -146,6 +165,15 @@ struct vhost_virtqueue {
 	struct vhost_ubuf_ref *ubufs;
 };
 
+/* Dirty log bitmap pinned at VHOST_SET_LOG_BASE time. */
+struct vhost_log_map {
+	void __user *base;
+	/* Guest pages, from 0, that can be logged through the map */
+	u64 nbits;
+	int npages;
+	struct page *pages[0];
+};
+
 struct vhost_dev {
 	/* Readers use RCU to access memory table pointer
 	 * log base pointer and features.
@@ -158,9 +186,12 @@ struct vhost_dev {
 	int nvqs;
 	struct file *log_file;
 	struct eventfd_ctx *log_ctx;
-	spinlock_t work_lock;
-	struct list_head work_list;
-	struct task_struct *worker;
+	/* Readers use RCU, as not all log writers hold the vq mutex.
+	 * Writers use the device mutex. */
+	struct vhost_log_map __rcu *log_map;
+	/* Up to one worker per virtqueue, indexed by worker id. Worker 0 is
+	 * created with the owner and runs device wide work. */
+	struct vhost_worker **workers;
 };
 
 long vhost_dev_init(struct vhost_dev *, struct vhost_virtqueue *vqs, int nvqs);
@@ -188,6 +219,8 @@ void vhost_add_used_and_signal_n(struct vhost_dev *, struct vhost_virtqueue *,
 void vhost_signal(struct vhost_dev *, struct vhost_virtqueue *);
 void vhost_disable_notify(struct vhost_dev *, struct vhost_virtqueue *);
 bool vhost_enable_notify(struct vhost_dev *, struct vhost_virtqueue *);
+bool vhost_vq_avail_empty(struct vhost_dev *, struct vhost_virtqueue *);
+bool vhost_vq_has_work(struct vhost_virtqueue *);
 
 int vhost_log_write(struct vhost_virtqueue *vq, struct vhost_log *log,
 		    unsigned int log_num, u64 len);
@@ -204,7 +237,8 @@ enum {
 	VHOST_FEATURES = (1ULL << VIRTIO_F_NOTIFY_ON_EMPTY) |
 			 (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |
 			 (1ULL << VIRTIO_RING_F_EVENT_IDX) |
-			 (1ULL << VHOST_F_LOG_ALL),
+			 (1ULL << VHOST_F_LOG_ALL) |
+			 (1ULL << VHOST_F_LOG_PINNED),
 	VHOST_NET_FEATURES = VHOST_FEATURES |
 			 (1ULL << VHOST_NET_F_VIRTIO_NET_HDR) |
 			 (1ULL << VIRTIO_NET_F_MRG_RXBUF),
@@ -35,6 +35,9 @@
  *			interrupts = <42>;
  *		}
  *
+ *    Devices offering VIRTIO_MMIO_F_PER_QUEUE_IRQ can be given one extra
+ *    interrupt per virtqueue, eg. interrupts = <42 43 44>;
+ *
  * 3. Kernel module (or command line) parameter. Can be used more than once -
  *    one device will be created for each one. Syntax:
  *
@@ -119,7 +122,13 @@ struct virtio_mmio_device {
 	void __iomem *base;
 	unsigned long version;
 
-	/* a list of queues so we can dispatch IRQs */
+	/* number of interrupts of the platform device */
+	unsigned int nr_irqs;
+
+	/* VIRTIO_MMIO_F_PER_QUEUE_IRQ has been negotiated */
+	bool per_queue_irq;
+
+	/* a list of queues using the shared IRQ, so we can dispatch it */
 	spinlock_t lock;
 	struct list_head virtqueues;
 };
@@ -136,6 +145,10 @@ struct virtio_mmio_vq_info {
 
 	/* the list node for the virtqueues list */
 	struct list_head node;
+
+	/* the queue's own interrupt, or 0 if it uses the shared one */
+	unsigned int irq;
+	char irq_name[32];
 };
 
 
@@ -155,11 +168,21 @@ static u32 vm_get_features(struct virtio_device *vdev)
 static void vm_finalize_features(struct virtio_device *vdev)
 {
 	struct virtio_mmio_device *vm_dev = to_virtio_mmio_device(vdev);
+	bool per_queue_irq;
 	int i;
 
+	/* Only worth it if the device has been given extra interrupts */
+	per_queue_irq = vm_dev->nr_irqs > 1 &&
+			test_bit(VIRTIO_MMIO_F_PER_QUEUE_IRQ, vdev->features);
+
 	/* Give virtio_ring a chance to accept features. */
 	vring_transport_features(vdev);
 
+	/* ...which clears the transport bits it doesn't know about */
+	if (per_queue_irq)
+		set_bit(VIRTIO_MMIO_F_PER_QUEUE_IRQ, vdev->features);
+	vm_dev->per_queue_irq = per_queue_irq;
+
 	for (i = 0; i < ARRAY_SIZE(vdev->features); i++) {
 		writel(i, vm_dev->base + VIRTIO_MMIO_GUEST_FEATURES_SEL);
 		writel(vdev->features[i],
@@ -228,7 +251,7 @@ static void vm_notify(struct virtqueue *vq)
 	writel(virtqueue_get_queue_index(vq), vm_dev->base + VIRTIO_MMIO_QUEUE_NOTIFY);
 }
 
-/* Notify all virtqueues on an interrupt. */
+/* Notify all virtqueues without an interrupt of their own. */
 static irqreturn_t vm_interrupt(int irq, void *opaque)
 {
 	struct virtio_mmio_device *vm_dev = opaque;
@@ -268,9 +291,14 @@ static void vm_del_vq(struct virtqueue *vq)
 	unsigned long flags, size;
 	unsigned int index = virtqueue_get_queue_index(vq);
 
-	spin_lock_irqsave(&vm_dev->lock, flags);
-	list_del(&info->node);
-	spin_unlock_irqrestore(&vm_dev->lock, flags);
+	if (info->irq) {
+		irq_set_affinity_hint(info->irq, NULL);
+		free_irq(info->irq, vq);
+	} else {
+		spin_lock_irqsave(&vm_dev->lock, flags);
+		list_del(&info->node);
+		spin_unlock_irqrestore(&vm_dev->lock, flags);
+	}
 
 	vring_del_virtqueue(vq);
 
@@ -375,12 +403,32 @@ static struct virtqueue *vm_setup_vq(struct virtio_device *vdev, unsigned index,
 	vq->priv = info;
 	info->vq = vq;
 
-	spin_lock_irqsave(&vm_dev->lock, flags);
-	list_add(&info->node, &vm_dev->virtqueues);
-	spin_unlock_irqrestore(&vm_dev->lock, flags);
+	/*
+	 * With per-queue interrupts, the device signals the queue directly
+	 * on its own line: no status register read and acknowledge, and no
+	 * walk of the other queues under vm_dev->lock.
+	 */
+	info->irq = 0;
+	if (vm_dev->per_queue_irq && callback && index + 1 < vm_dev->nr_irqs)
+		info->irq = platform_get_irq(vm_dev->pdev, index + 1);
+
+	if (info->irq) {
+		snprintf(info->irq_name, sizeof(info->irq_name), "%s-%s",
+			 dev_name(&vdev->dev), name);
+		err = request_irq(info->irq, vring_interrupt, 0,
+				  info->irq_name, vq);
+		if (err)
+			goto error_request_irq;
+	} else {
+		spin_lock_irqsave(&vm_dev->lock, flags);
+		list_add(&info->node, &vm_dev->virtqueues);
+		spin_unlock_irqrestore(&vm_dev->lock, flags);
+	}
 
 	return vq;
 
+error_request_irq:
+	vring_del_virtqueue(vq);
 error_new_virtqueue:
 	writel(0, vm_dev->base + VIRTIO_MMIO_QUEUE_PFN);
 	free_pages_exact(info->queue, size);
@@ -416,6 +464,22 @@ static int vm_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	return 0;
 }
 
+static int vm_set_vq_affinity(struct virtqueue *vq, int cpu)
+{
+	struct virtio_mmio_vq_info *info = vq->priv;
+
+	/* Queues sharing the device interrupt can't be steered */
+	if (!info->irq)
+		return -EINVAL;
+
+	if (cpu == -1)
+		irq_set_affinity_hint(info->irq, NULL);
+	else
+		irq_set_affinity_hint(info->irq, cpumask_of(cpu));
+
+	return 0;
+}
+
 static const char *vm_bus_name(struct virtio_device *vdev)
 {
 	struct virtio_mmio_device *vm_dev = to_virtio_mmio_device(vdev);
@@ -434,6 +498,7 @@ static struct virtio_config_ops virtio_mmio_config_ops = {
 	.get_features	= vm_get_features,
 	.finalize_features = vm_finalize_features,
 	.bus_name	= vm_bus_name,
+	.set_vq_affinity = vm_set_vq_affinity,
 };
 
 
@@ -486,6 +551,9 @@ static int __devinit virtio_mmio_probe(struct platform_device *pdev)
 	vm_dev->vdev.id.device = readl(vm_dev->base + VIRTIO_MMIO_DEVICE_ID);
 	vm_dev->vdev.id.vendor = readl(vm_dev->base + VIRTIO_MMIO_VENDOR_ID);
 
+	while (platform_get_irq(pdev, vm_dev->nr_irqs) >= 0)
+		vm_dev->nr_irqs++;
+
 	writel(PAGE_SIZE, vm_dev->base + VIRTIO_MMIO_GUEST_PAGE_SIZE);
 
 	platform_set_drvdata(pdev, vm_dev);
@@ -108,4 +108,16 @@
 #define VIRTIO_MMIO_INT_VRING		(1 << 0)
 #define VIRTIO_MMIO_INT_CONFIG		(1 << 1)
 
+
+
+/*
+ * Transport feature bits
+ */
+
+/* Per-queue interrupts: queue n is signalled on the device's interrupt
+ * n + 1 (when there is one), which is edge triggered and not reflected
+ * in the interrupt status register. Other queues and configuration
+ * changes keep using the first interrupt. */
+#define VIRTIO_MMIO_F_PER_QUEUE_IRQ	31
+
 #endif
@@ -636,6 +636,8 @@ struct kvm_ppc_smmu_info {
 #define KVM_CAP_IRQFD_RESAMPLE 82
 #define KVM_CAP_PPC_BOOKE_WATCHDOG 83
 #define KVM_CAP_SET_DEVICE_ADDR 84
+#define KVM_CAP_ONE_REG_BATCH 85
+#define KVM_CAP_ARM_VGIC_STATE 86
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -775,6 +777,13 @@ struct kvm_one_reg {
 	__u64 addr;
 };
 
+struct kvm_reg_batch {
+	__u64 n;	/* number of registers */
+	__u64 ids;	/* __u64 ids[n] */
+	__u64 errors;	/* __s32 errors[n], filled in by the kernel */
+	__u64 addr;	/* register values, packed in ids[] order */
+};
+
 struct kvm_msi {
 	__u32 address_lo;
 	__u32 address_hi;
@@ -873,6 +882,9 @@ struct kvm_s390_ucas_mapping {
 #define KVM_ALLOCATE_RMA	  _IOR(KVMIO,  0xa9, struct kvm_allocate_rma)
 /* Available with KVM_CAP_SET_DEVICE_ADDR */
 #define KVM_SET_DEVICE_ADDRESS	  _IOW(KVMIO,  0xaa, struct kvm_device_address)
+/* Available with KVM_CAP_ARM_VGIC_STATE */
+#define KVM_ARM_GET_VGIC_STATE	  _IOWR(KVMIO, 0xb3, struct kvm_arm_vgic_state)
+#define KVM_ARM_SET_VGIC_STATE	  _IOW(KVMIO,  0xb4, struct kvm_arm_vgic_state)
 
 /*
  * ioctls for vcpu fds
@@ -945,6 +957,9 @@ struct kvm_s390_ucas_mapping {
 #define KVM_KVMCLOCK_CTRL	  _IO(KVMIO,   0xad)
 #define KVM_ARM_VCPU_INIT	  _IOW(KVMIO,  0xae, struct kvm_vcpu_init)
 #define KVM_GET_REG_LIST	  _IOWR(KVMIO, 0xb0, struct kvm_reg_list)
+/* Available with KVM_CAP_ONE_REG_BATCH */
+#define KVM_GET_REG_BATCH	  _IOW(KVMIO,  0xb1, struct kvm_reg_batch)
+#define KVM_SET_REG_BATCH	  _IOW(KVMIO,  0xb2, struct kvm_reg_batch)
 
 #define KVM_DEV_ASSIGN_ENABLE_IOMMU	(1 << 0)
 #define KVM_DEV_ASSIGN_PCI_2_3		(1 << 1)
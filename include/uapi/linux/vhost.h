@@ -86,7 +86,8 @@ struct vhost_memory {
 /* Write logging setup. */
 /* Memory writes can optionally be logged by setting bit at an offset
  * (calculated from the physical address) from specified log base.
- * The bit is set using an atomic 32 bit operation. */
+ * The bit is set using an atomic operation, on a long sized word when the
+ * log is pinned (see VHOST_F_LOG_PINNED). */
 /* Set base address for logging. */
 #define VHOST_SET_LOG_BASE _IOW(VHOST_VIRTIO, 0x04, __u64)
 /* Specify an eventfd file descriptor to signal on log write. */
@@ -102,6 +103,13 @@ struct vhost_memory {
 #define VHOST_SET_VRING_BASE _IOW(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
 /* Get accessor: reads index, writes value in num */
 #define VHOST_GET_VRING_BASE _IOWR(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
+/* Bind the ring to the worker thread with id num, creating the worker if
+ * needed. Ids range from 0 to the number of rings minus one, worker 0 being
+ * the one created by VHOST_SET_OWNER. Can't be done while the ring has a
+ * backend or a kick eventfd. */
+#define VHOST_SET_VRING_WORKER _IOW(VHOST_VIRTIO, 0x13, struct vhost_vring_state)
+/* Get accessor: reads index, writes worker id in num */
+#define VHOST_GET_VRING_WORKER _IOWR(VHOST_VIRTIO, 0x13, struct vhost_vring_state)
 
 /* The following ioctls use eventfd file descriptors to signal and poll
  * for events. */
@@ -112,6 +120,14 @@ struct vhost_memory {
 #define VHOST_SET_VRING_CALL _IOW(VHOST_VIRTIO, 0x21, struct vhost_vring_file)
 /* Set eventfd to signal an error */
 #define VHOST_SET_VRING_ERR _IOW(VHOST_VIRTIO, 0x22, struct vhost_vring_file)
+/* Set busy loop timeout (in us): after running out of work, keep polling
+ * with guest notifications disabled for this long before going to sleep.
+ * 0 (the default) disables busy polling. */
+#define VHOST_SET_VRING_BUSYLOOP_TIMEOUT _IOW(VHOST_VIRTIO, 0x23,	\
+					 struct vhost_vring_state)
+/* Get accessor: reads index, writes value in num */
+#define VHOST_GET_VRING_BUSYLOOP_TIMEOUT _IOWR(VHOST_VIRTIO, 0x24,	\
+					 struct vhost_vring_state)
 
 /* VHOST_NET specific defines */
 
@@ -124,6 +140,12 @@ struct vhost_memory {
 /* Feature bits */
 /* Log all write descriptors. Can be changed while device is active. */
 #define VHOST_F_LOG_ALL 26
+/* Pin the log covering the memory table at VHOST_SET_LOG_BASE, rather than
+ * look each log page up again on every write. By acking this, the owner
+ * promises that it does not fork, or has marked the log MADV_DONTFORK:
+ * copy-on-write would otherwise leave vhost setting bits in pages the owner
+ * no longer sees. Takes effect at the next VHOST_SET_LOG_BASE. */
+#define VHOST_F_LOG_PINNED 25
 /* vhost-net should add virtio_net_hdr for RX, and strip for TX packets. */
 #define VHOST_NET_F_VIRTIO_NET_HDR 27
 
@@ -35,6 +35,7 @@
 
 #include "iodev.h"
 
+#ifdef CONFIG_HAVE_KVM_IRQFD
 /*
  * --------------------------------------------------------------------
  * irqfd: Allows an fd to be used to inject an interrupt to the guest
@@ -72,8 +73,10 @@ struct _irqfd {
 	/* Used for MSI fast-path */
 	struct kvm *kvm;
 	wait_queue_t wait;
+#ifdef KVM_CAP_IRQ_ROUTING
 	/* Update side is protected by irqfds.lock */
 	struct kvm_kernel_irq_routing_entry __rcu *irq_entry;
+#endif
 	/* Used for level IRQ fast-path */
 	int gsi;
 	struct work_struct inject;
@@ -216,10 +219,12 @@ irqfd_wakeup(wait_queue_t *wait, unsigned mode, int sync, void *key)
 {
 	struct _irqfd *irqfd = container_of(wait, struct _irqfd, wait);
 	unsigned long flags = (unsigned long)key;
-	struct kvm_kernel_irq_routing_entry *irq;
 	struct kvm *kvm = irqfd->kvm;
 
 	if (flags & POLLIN) {
+#ifdef KVM_CAP_IRQ_ROUTING
+		struct kvm_kernel_irq_routing_entry *irq;
+
 		rcu_read_lock();
 		irq = rcu_dereference(irqfd->irq_entry);
 		/* An event has been signaled, inject an interrupt */
@@ -228,6 +233,10 @@ irqfd_wakeup(wait_queue_t *wait, unsigned mode, int sync, void *key)
 		else
 			schedule_work(&irqfd->inject);
 		rcu_read_unlock();
+#else
+		/* An event has been signaled, inject an interrupt */
+		schedule_work(&irqfd->inject);
+#endif
 	}
 
 	if (flags & POLLHUP) {
@@ -262,6 +271,7 @@ irqfd_ptable_queue_proc(struct file *file, wait_queue_head_t *wqh,
 	add_wait_queue(wqh, &irqfd->wait);
 }
 
+#ifdef KVM_CAP_IRQ_ROUTING
 /* Must be called under irqfds.lock */
 static void irqfd_update(struct kvm *kvm, struct _irqfd *irqfd,
 			 struct kvm_irq_routing_table *irq_rt)
@@ -282,11 +292,14 @@ static void irqfd_update(struct kvm *kvm, struct _irqfd *irqfd,
 			rcu_assign_pointer(irqfd->irq_entry, NULL);
 	}
 }
+#endif
 
 static int
 kvm_irqfd_assign(struct kvm *kvm, struct kvm_irqfd *args)
 {
+#ifdef KVM_CAP_IRQ_ROUTING
 	struct kvm_irq_routing_table *irq_rt;
+#endif
 	struct _irqfd *irqfd, *tmp;
 	struct file *file = NULL;
 	struct eventfd_ctx *eventfd = NULL, *resamplefd = NULL;
@@ -384,9 +397,11 @@ kvm_irqfd_assign(struct kvm *kvm, struct kvm_irqfd *args)
 		goto fail;
 	}
 
+#ifdef KVM_CAP_IRQ_ROUTING
 	irq_rt = rcu_dereference_protected(kvm->irq_routing,
 					   lockdep_is_held(&kvm->irqfds.lock));
 	irqfd_update(kvm, irqfd, irq_rt);
+#endif
 
 	events = file->f_op->poll(file, &irqfd->pt);
 
@@ -426,16 +441,6 @@ fail:
 	return ret;
 }
 
-void
-kvm_eventfd_init(struct kvm *kvm)
-{
-	spin_lock_init(&kvm->irqfds.lock);
-	INIT_LIST_HEAD(&kvm->irqfds.items);
-	INIT_LIST_HEAD(&kvm->irqfds.resampler_list);
-	mutex_init(&kvm->irqfds.resampler_lock);
-	INIT_LIST_HEAD(&kvm->ioeventfds);
-}
-
 /*
  * shutdown any irqfd's that match fd+gsi
  */
@@ -453,6 +458,7 @@ kvm_irqfd_deassign(struct kvm *kvm, struct kvm_irqfd *args)
 
 	list_for_each_entry_safe(irqfd, tmp, &kvm->irqfds.items, list) {
 		if (irqfd->eventfd == eventfd && irqfd->gsi == args->gsi) {
+#ifdef KVM_CAP_IRQ_ROUTING
 			/*
 			 * This rcu_assign_pointer is needed for when
 			 * another thread calls kvm_irq_routing_update before
@@ -462,6 +468,7 @@ kvm_irqfd_deassign(struct kvm *kvm, struct kvm_irqfd *args)
 			 * of that function.
 			 */
 			rcu_assign_pointer(irqfd->irq_entry, NULL);
+#endif
 			irqfd_deactivate(irqfd);
 		}
 	}
@@ -515,6 +522,7 @@ kvm_irqfd_release(struct kvm *kvm)
 
 }
 
+#ifdef KVM_CAP_IRQ_ROUTING
 /*
  * Change irq_routing and irqfd.
  * Caller must invoke synchronize_rcu afterwards.
@@ -533,6 +541,7 @@ void kvm_irq_routing_update(struct kvm *kvm,
 
 	spin_unlock_irq(&kvm->irqfds.lock);
 }
+#endif
 
 /*
  * create a host-wide workqueue for issuing deferred shutdown requests
@@ -555,6 +564,19 @@ static void __exit irqfd_module_exit(void)
 
 module_init(irqfd_module_init);
 module_exit(irqfd_module_exit);
+#endif /* CONFIG_HAVE_KVM_IRQFD */
+
+void
+kvm_eventfd_init(struct kvm *kvm)
+{
+#ifdef CONFIG_HAVE_KVM_IRQFD
+	spin_lock_init(&kvm->irqfds.lock);
+	INIT_LIST_HEAD(&kvm->irqfds.items);
+	INIT_LIST_HEAD(&kvm->irqfds.resampler_list);
+	mutex_init(&kvm->irqfds.resampler_lock);
+#endif
+	INIT_LIST_HEAD(&kvm->ioeventfds);
+}
 
 /*
  * --------------------------------------------------------------------
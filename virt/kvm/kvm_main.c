@@ -642,17 +642,22 @@ static int cmp_memslot(const void *slot1, const void *slot2)
 	s1 = (struct kvm_memory_slot *)slot1;
 	s2 = (struct kvm_memory_slot *)slot2;
 
-	if (s1->npages < s2->npages)
+	/* Empty slots go last */
+	if (!s1->npages || !s2->npages)
+		return !s1->npages - !s2->npages;
+
+	if (s1->base_gfn < s2->base_gfn)
 		return 1;
-	if (s1->npages > s2->npages)
+	if (s1->base_gfn > s2->base_gfn)
 		return -1;
 
 	return 0;
 }
 
 /*
- * Sort the memslots base on its size, so the larger slots
- * will get better fit.
+ * Sort the memslots by base gfn in descending order, with the empty slots
+ * at the end, so that search_memslots() can do a binary search and
+ * kvm_for_each_memslot() can stop at the first empty slot.
  */
 static void sort_memslots(struct kvm_memslots *slots)
 {
@@ -661,8 +666,15 @@ static void sort_memslots(struct kvm_memslots *slots)
 	sort(slots->memslots, KVM_MEM_SLOTS_NUM,
 	      sizeof(struct kvm_memory_slot), cmp_memslot, NULL);
 
-	for (i = 0; i < KVM_MEM_SLOTS_NUM; i++)
+	slots->used_slots = 0;
+	for (i = 0; i < KVM_MEM_SLOTS_NUM; i++) {
 		slots->id_to_index[slots->memslots[i].id] = i;
+		if (slots->memslots[i].npages)
+			slots->used_slots++;
+	}
+
+	/* The cached index may now point to a different slot */
+	atomic_set(&slots->lru_slot, 0);
 }
 
 void update_memslots(struct kvm_memslots *slots, struct kvm_memory_slot *new)
@@ -671,9 +683,10 @@ void update_memslots(struct kvm_memslots *slots, struct kvm_memory_slot *new)
 		int id = new->id;
 		struct kvm_memory_slot *old = id_to_memslot(slots, id);
 		unsigned long npages = old->npages;
+		gfn_t base_gfn = old->base_gfn;
 
 		*old = *new;
-		if (new->npages != npages)
+		if (new->npages != npages || new->base_gfn != base_gfn)
 			sort_memslots(slots);
 	}
 
@@ -1697,7 +1710,10 @@ bool kvm_vcpu_eligible_for_directed_yield(struct kvm_vcpu *vcpu)
 	return eligible;
 }
 #endif
-void kvm_vcpu_on_spin(struct kvm_vcpu *me)
+/*
+ * Returns true if we managed to yield to another vcpu of the same VM.
+ */
+bool kvm_vcpu_on_spin(struct kvm_vcpu *me)
 {
 	struct kvm *kvm = me->kvm;
 	struct kvm_vcpu *vcpu;
@@ -1738,6 +1754,8 @@ void kvm_vcpu_on_spin(struct kvm_vcpu *me)
 
 	/* Ensure vcpu is not eligible during next spinloop */
 	kvm_vcpu_set_dy_eligible(me, false);
+
+	return yielded;
 }
 EXPORT_SYMBOL_GPL(kvm_vcpu_on_spin);
 